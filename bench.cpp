@@ -0,0 +1,368 @@
+#include "fork-number-tree.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono;
+
+/*
+Benchmark driver for the partitioned maps. Every configuration preloads a map with --keys pairs,
+runs --warmup untimed passes and --reps timed passes of --ops operations split over the worker
+threads, then prints one CSV line or JSON object per configuration.
+
+Sweeps: map geometry (keySize, childCount, levelCount), partition lock policy, flat combining, key distribution,
+read percentage and thread count from 1 up to --max-threads, which defaults to the number of cores.
+*/
+
+struct BenchOptions {
+	size_t keys = 200000;
+	size_t ops = 400000;
+	size_t reps = 3;
+	size_t warmup = 1;
+	size_t maxThreads = std::thread::hardware_concurrency() == 0 ? 1 : std::thread::hardware_concurrency();
+	bool json = false;
+	FILE* out = stdout;
+};
+
+enum Distribution {
+	UNIFORM,
+	SEQUENTIAL,
+	ZIPFIAN
+};
+
+static const char* distributionName(Distribution dist) {
+	switch (dist) {
+		case UNIFORM: return "uniform";
+		case SEQUENTIAL: return "sequential";
+		case ZIPFIAN: return "zipfian";
+	}
+	return "unknown";
+}
+
+struct BenchResult {
+	double mopsMean = 0;
+	double mopsBest = 0;
+	double p50Nanos = 0;
+	double p99Nanos = 0;
+	double bytesPerKey = 0;
+};
+
+struct Operation {
+	size_t index;
+	bool write;
+};
+
+// one op in latencySample is timed on its own, the rest only count towards throughput
+static constexpr size_t latencySample = 16;
+static constexpr double zipfTheta = 0.99;
+
+static std::vector<FNTree::KeyValuePair*> BENCH_KEYS;
+
+static void populateKeys(size_t count) {
+	std::mt19937_64 gen(42);
+	for (size_t i = 0; i < count; ++i)
+	{
+		FNTree::KeyValuePair* kvp = new FNTree::KeyValuePair();
+		for (size_t j = 0; j < sizeof(kvp->key); j += sizeof(uint64_t))
+		{
+			uint64_t word = gen();
+			std::memcpy(kvp->key + j, &word, sizeof(word));
+		}
+		kvp->value = (void*)(i + 1);
+		BENCH_KEYS.push_back(kvp);
+	}
+}
+
+static void freeKeys() {
+	for (size_t i = 0; i < BENCH_KEYS.size(); ++i)
+	{
+		delete BENCH_KEYS[i];
+	}
+	BENCH_KEYS.clear();
+}
+
+/*Cumulative distribution of a Zipfian over count ranks, key 0 is the hottest.*/
+static std::vector<double> zipfTable(size_t count) {
+	std::vector<double> cdf(count);
+	double sum = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		sum += 1.0 / std::pow((double)(i + 1), zipfTheta);
+		cdf[i] = sum;
+	}
+	for (size_t i = 0; i < count; ++i)
+	{
+		cdf[i] /= sum;
+	}
+	return cdf;
+}
+
+/*Operations are drawn before the clock starts, so generating keys is never timed.*/
+static std::vector<Operation> makeOperations(size_t count, size_t keys, Distribution dist, size_t readPercent, const std::vector<double>& zipf, uint64_t seed) {
+	std::mt19937_64 gen(seed);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	std::vector<Operation> ops(count);
+	size_t next = (size_t)(seed % keys);
+	for (size_t i = 0; i < count; ++i)
+	{
+		size_t index = 0;
+		if (dist == UNIFORM) {
+			index = (size_t)(gen() % keys);
+		} else if (dist == SEQUENTIAL) {
+			index = next;
+			next = next + 1 == keys ? 0 : next + 1;
+		} else {
+			index = (size_t)(std::lower_bound(zipf.begin(), zipf.end(), unit(gen)) - zipf.begin());
+			if (index >= keys) {
+				index = keys - 1;
+			}
+		}
+		ops[i].index = index;
+		ops[i].write = (gen() % 100) >= readPercent;
+	}
+	return ops;
+}
+
+static double percentile(std::vector<uint32_t>& samples, double fraction) {
+	if (samples.empty()) {
+		return 0;
+	}
+	size_t at = (size_t)(fraction * (double)(samples.size() - 1));
+	std::nth_element(samples.begin(), samples.begin() + at, samples.end());
+	return samples[at];
+}
+
+template <class Map>
+static size_t runOps(Map& map, const std::vector<Operation>& ops, std::vector<uint32_t>* latencies) {
+	size_t adder = 0;
+	for (size_t i = 0; i < ops.size(); ++i)
+	{
+		FNTree::KeyValuePair* kvp = BENCH_KEYS[ops[i].index];
+		bool timed = latencies != nullptr && i % latencySample == 0;
+		steady_clock::time_point start;
+		if (timed) {
+			start = steady_clock::now();
+		}
+		if (ops[i].write) {
+			map.insert(kvp);
+		} else {
+			adder += (size_t)map.find(kvp);
+		}
+		if (timed) {
+			latencies->push_back((uint32_t)duration_cast<nanoseconds>(steady_clock::now() - start).count());
+		}
+	}
+	return adder;
+}
+
+template <class Map>
+static BenchResult runConfig(const BenchOptions& opts, Distribution dist, size_t readPercent, size_t threads, bool combine, const std::vector<double>& zipf) {
+	BenchResult result;
+	FNTree::MapOptions mapOptions;
+	mapOptions.combineWrites = combine;
+	Map* map = new Map(mapOptions);
+	map->bulkLoad(BENCH_KEYS.data(), BENCH_KEYS.size());
+	result.bytesPerKey = (double)map->stats().total.bytes() / (double)BENCH_KEYS.size();
+
+	std::vector<std::vector<Operation>> ops(threads);
+	for (size_t t = 0; t < threads; ++t)
+	{
+		ops[t] = makeOperations(opts.ops / threads, BENCH_KEYS.size(), dist, readPercent, zipf, 1000 + t);
+	}
+	std::vector<uint32_t> latencies;
+	std::atomic<size_t> sink(0);
+	for (size_t rep = 0; rep < opts.warmup + opts.reps; ++rep)
+	{
+		bool timed = rep >= opts.warmup;
+		std::vector<std::vector<uint32_t>> samples(threads);
+		std::vector<std::thread> pool;
+		std::atomic<bool> waitForStart(true);
+		for (size_t t = 0; t < threads; ++t)
+		{
+			pool.emplace_back([&, t]{
+				samples[t].reserve(ops[t].size() / latencySample + 1);
+				while (waitForStart.load()) {
+					std::this_thread::yield();
+				}
+				sink += runOps(*map, ops[t], timed ? &samples[t] : nullptr);
+			});
+		}
+		auto start = steady_clock::now();
+		waitForStart.store(false);
+		for (size_t t = 0; t < threads; ++t)
+		{
+			pool[t].join();
+		}
+		double seconds = duration_cast<duration<double>>(steady_clock::now() - start).count();
+		if (!timed) {
+			continue;
+		}
+		double mops = (double)(opts.ops / threads * threads) / seconds / 1e6;
+		result.mopsMean += mops / (double)opts.reps;
+		result.mopsBest = std::max(result.mopsBest, mops);
+		for (size_t t = 0; t < threads; ++t)
+		{
+			latencies.insert(latencies.end(), samples[t].begin(), samples[t].end());
+		}
+	}
+	result.p50Nanos = percentile(latencies, 0.50);
+	result.p99Nanos = percentile(latencies, 0.99);
+	delete map;
+	return result;
+}
+
+struct Reporter {
+	const BenchOptions& _opts;
+	bool _first = true;
+
+	explicit Reporter(const BenchOptions& opts) : _opts(opts) {
+		if (_opts.json) {
+			std::fprintf(_opts.out, "[\n");
+		} else {
+			std::fprintf(_opts.out, "keySize,childCount,levelCount,lock,combine,distribution,readPercent,threads,keys,ops,reps,mopsMean,mopsBest,p50Nanos,p99Nanos,bytesPerKey\n");
+		}
+	}
+
+	~Reporter() {
+		if (_opts.json) {
+			std::fprintf(_opts.out, "\n]\n");
+		}
+	}
+
+	void row(size_t keySize, size_t childCount, size_t levels, const char* lock, bool combine, Distribution dist, size_t readPercent, size_t threads, const BenchResult& res) {
+		if (_opts.json) {
+			std::fprintf(_opts.out, "%s  {\"keySize\":%zu,\"childCount\":%zu,\"levelCount\":%zu,\"lock\":\"%s\",\"combine\":%s,\"distribution\":\"%s\",\"readPercent\":%zu,\"threads\":%zu,"
+				"\"keys\":%zu,\"ops\":%zu,\"reps\":%zu,\"mopsMean\":%.4f,\"mopsBest\":%.4f,\"p50Nanos\":%.0f,\"p99Nanos\":%.0f,\"bytesPerKey\":%.2f}",
+				_first ? "" : ",\n", keySize, childCount, levels, lock, combine ? "true" : "false", distributionName(dist), readPercent, threads,
+				_opts.keys, _opts.ops, _opts.reps, res.mopsMean, res.mopsBest, res.p50Nanos, res.p99Nanos, res.bytesPerKey);
+		} else {
+			std::fprintf(_opts.out, "%zu,%zu,%zu,%s,%d,%s,%zu,%zu,%zu,%zu,%zu,%.4f,%.4f,%.0f,%.0f,%.2f\n",
+				keySize, childCount, levels, lock, (int)combine, distributionName(dist), readPercent, threads,
+				_opts.keys, _opts.ops, _opts.reps, res.mopsMean, res.mopsBest, res.p50Nanos, res.p99Nanos, res.bytesPerKey);
+		}
+		std::fflush(_opts.out);
+		_first = false;
+	}
+};
+
+static std::vector<size_t> threadCounts(size_t maxThreads) {
+	std::vector<size_t> counts;
+	for (size_t t = 1; t < maxThreads; t *= 2)
+	{
+		counts.push_back(t);
+	}
+	counts.push_back(maxThreads);
+	return counts;
+}
+
+static const char* lockName(const FNTree::MutexLock*) {
+	return "mutex";
+}
+
+static const char* lockName(const FNTree::SpinLock*) {
+	return "spin";
+}
+
+static const char* lockName(const FNTree::SharedLock*) {
+	return "shared";
+}
+
+template <size_t keySize, size_t childCount, size_t levels, class Lock = FNTree::MutexLock>
+static void sweepGeometry(const BenchOptions& opts, Reporter& report, const std::vector<double>& zipf, bool combine = false) {
+	typedef FNTree::BasicMapObj<FNTree::SlabAllocator, keySize, childCount, levels, Lock> Map;
+	static const Distribution dists[] = {UNIFORM, SEQUENTIAL, ZIPFIAN};
+	static const size_t readPercents[] = {100, 95, 50, 0};
+	std::vector<size_t> threads = threadCounts(opts.maxThreads);
+	for (Distribution dist : dists)
+	{
+		for (size_t readPercent : readPercents)
+		{
+			for (size_t threadCount : threads)
+			{
+				BenchResult res = runConfig<Map>(opts, dist, readPercent, threadCount, combine, zipf);
+				report.row(keySize, childCount, levels, lockName((Lock*)nullptr), combine, dist, readPercent, threadCount, res);
+			}
+		}
+	}
+}
+
+static void usage(const char* name) {
+	std::fprintf(stderr,
+		"usage: %s [--keys N] [--ops N] [--reps N] [--warmup N] [--max-threads N] [--format csv|json] [--out PATH]\n", name);
+}
+
+int main(int argc, char const *argv[])
+{
+	BenchOptions opts;
+	for (int i = 1; i < argc; ++i)
+	{
+		const char* arg = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (value == nullptr) {
+			usage(argv[0]);
+			return 1;
+		}
+		if (std::strcmp(arg, "--keys") == 0) {
+			opts.keys = std::strtoull(value, nullptr, 10);
+		} else if (std::strcmp(arg, "--ops") == 0) {
+			opts.ops = std::strtoull(value, nullptr, 10);
+		} else if (std::strcmp(arg, "--reps") == 0) {
+			opts.reps = std::strtoull(value, nullptr, 10);
+		} else if (std::strcmp(arg, "--warmup") == 0) {
+			opts.warmup = std::strtoull(value, nullptr, 10);
+		} else if (std::strcmp(arg, "--max-threads") == 0) {
+			opts.maxThreads = std::strtoull(value, nullptr, 10);
+		} else if (std::strcmp(arg, "--format") == 0) {
+			opts.json = std::strcmp(value, "json") == 0;
+		} else if (std::strcmp(arg, "--out") == 0) {
+			opts.out = std::fopen(value, "w");
+			if (opts.out == nullptr) {
+				std::perror(value);
+				return 1;
+			}
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+		i += 1;
+	}
+	if (opts.keys == 0 || opts.ops == 0 || opts.reps == 0 || opts.maxThreads == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	populateKeys(opts.keys);
+	std::vector<double> zipf = zipfTable(opts.keys);
+	{
+		Reporter report(opts);
+		// childCount at about the same key width
+		sweepGeometry<24, 16, 2>(opts, report, zipf);
+		sweepGeometry<25, 32, 2>(opts, report, zipf);
+		sweepGeometry<24, 64, 2>(opts, report, zipf);
+		// keySize
+		sweepGeometry<20, 32, 2>(opts, report, zipf);
+		sweepGeometry<30, 32, 2>(opts, report, zipf);
+		// levelCount
+		sweepGeometry<25, 32, 1>(opts, report, zipf);
+		sweepGeometry<25, 32, 3>(opts, report, zipf);
+		// partition lock policy
+		sweepGeometry<25, 32, 2, FNTree::SpinLock>(opts, report, zipf);
+		sweepGeometry<25, 32, 2, FNTree::SharedLock>(opts, report, zipf);
+		// flat combining write path
+		sweepGeometry<25, 32, 2>(opts, report, zipf, true);
+	}
+	if (opts.out != stdout) {
+		std::fclose(opts.out);
+	}
+	freeKeys();
+	return 0;
+}
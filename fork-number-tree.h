@@ -4,9 +4,39 @@
 #include <cstdio>
 #include <cstdint>
 #include <cstdlib>
+#include <cstddef>
 #include <cstring>
 #include <climits>
+#include <new>
+#include <stdexcept>
 #include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// event counters are compiled in with -DFNTREE_STATS=1, walked structure stats are always available
+#ifndef FNTREE_STATS
+#define FNTREE_STATS 0
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define FNTREE_HAS_MMAP 1
+#endif
 
 namespace FNTree {
 	struct BitCovers {
@@ -24,15 +54,89 @@ namespace FNTree {
 
 	static constexpr BitCovers BIT_COVERS;
 
-	inline constexpr size_t hashData(void* data, size_t size) {
-		size_t hash = 5381;
-		uint64_t* reader = (uint64_t*)data;
-		size_t count = size / sizeof(uint64_t);
-		for (size_t i = 0; i < count; ++i)
-		{
-			hash = ((hash << 5) + hash) ^ reader[i];
+	/*64x64 -> 128 bit multiply, low half left in a and high half in b.*/
+	inline void mulFold(uint64_t* a, uint64_t* b) {
+	#if defined(__SIZEOF_INT128__)
+		__uint128_t r = (__uint128_t)*a * *b;
+		*a = (uint64_t)r;
+		*b = (uint64_t)(r >> 64);
+	#elif defined(_MSC_VER) && defined(_M_X64)
+		*a = _umul128(*a, *b, b);
+	#else
+		uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+		uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+		uint64_t t = rl + (rm0 << 32);
+		uint64_t c = t < rl;
+		uint64_t lo = t + (rm1 << 32);
+		c += lo < t;
+		*a = lo;
+		*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+	#endif
+	}
+
+	inline uint64_t mixFold(uint64_t a, uint64_t b) {
+		mulFold(&a, &b);
+		return a ^ b;
+	}
+
+	inline uint64_t readBytes8(const unsigned char* p) {
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	inline uint64_t readBytes4(const unsigned char* p) {
+		uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	/*wyhash style 64 bit hash of any number of bytes, tail bytes included. Every output bit
+	  depends on every input bit, so all of the hash can be used to pick tree slots and tags.*/
+	inline uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0) {
+		static constexpr uint64_t secret[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL};
+		const unsigned char* p = (const unsigned char*)data;
+		seed ^= mixFold(seed ^ secret[0], secret[1]);
+		uint64_t a = 0;
+		uint64_t b = 0;
+		if (size <= 16) {
+			if (size >= 4) {
+				size_t mid = (size >> 3) << 2;
+				a = (readBytes4(p) << 32) | readBytes4(p + mid);
+				b = (readBytes4(p + size - 4) << 32) | readBytes4(p + size - 4 - mid);
+			} else if (size > 0) {
+				a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+			}
+		} else {
+			size_t left = size;
+			if (left > 48) {
+				uint64_t seed1 = seed;
+				uint64_t seed2 = seed;
+				do {
+					seed = mixFold(readBytes8(p) ^ secret[1], readBytes8(p + 8) ^ seed);
+					seed1 = mixFold(readBytes8(p + 16) ^ secret[2], readBytes8(p + 24) ^ seed1);
+					seed2 = mixFold(readBytes8(p + 32) ^ secret[3], readBytes8(p + 40) ^ seed2);
+					p += 48;
+					left -= 48;
+				} while (left > 48);
+				seed ^= seed1 ^ seed2;
+			}
+			while (left > 16) {
+				seed = mixFold(readBytes8(p) ^ secret[1], readBytes8(p + 8) ^ seed);
+				p += 16;
+				left -= 16;
+			}
+			a = readBytes8(p + left - 16);
+			b = readBytes8(p + left - 8);
 		}
-		return hash;
+		a ^= secret[1];
+		b ^= seed;
+		mulFold(&a, &b);
+		return mixFold(a ^ secret[0] ^ size, b ^ secret[1]);
+	}
+
+	inline size_t hashData(void* data, size_t size) {
+		return (size_t)hashBytes(data, size);
 	}
 
 	struct KeyValuePair {
@@ -77,397 +181,5293 @@ namespace FNTree {
 		struct KeyValueSpot* next = nullptr;
 	};
 
-	struct ParitionLock {
-		std::mutex mux;
-	};
+	/*Chain entry for arbitrary length keys, the key bytes are copied right after the header.
+	  The full hash is kept so mismatches are rejected before comparing bytes.*/
+	struct KeyBlobSpot {
+		size_t hash = 0;
+		size_t len = 0;
+		void* value = nullptr;
+		struct KeyBlobSpot* next = nullptr;
 
-	struct ScopedPartLock {
-		ScopedPartLock(ParitionLock* ptl):_ptl(ptl) {
-			_ptl->mux.lock();
+		unsigned char* key() {
+			return (unsigned char*)(this + 1);
 		}
 
-		~ScopedPartLock() {
-			_ptl->mux.unlock();
+		bool matches(size_t keyHash, const void* keyData, size_t keyLen) {
+			return hash == keyHash && len == keyLen && std::memcmp(key(), keyData, keyLen) == 0;
+		}
+
+		template <class Alloc>
+		static KeyBlobSpot* make(size_t keyHash, const void* keyData, size_t keyLen, Alloc& alloc) {
+			KeyBlobSpot* spot = new (alloc.allocate(sizeof(KeyBlobSpot) + keyLen, alignof(KeyBlobSpot))) KeyBlobSpot();
+			spot->hash = keyHash;
+			spot->len = keyLen;
+			std::memcpy(spot->key(), keyData, keyLen);
+			return spot;
 		}
 
-		ParitionLock* _ptl;
+		template <class Alloc>
+		static void drop(KeyBlobSpot* spot, Alloc& alloc) {
+			alloc.recycle(spot, sizeof(KeyBlobSpot) + spot->len, alignof(KeyBlobSpot));
+		}
 	};
 
-	constexpr size_t getPartitionCount(size_t level, size_t childCount) {
-		size_t total = 0;
-		size_t childCumulative = childCount;
-		for (size_t i = 0; i < level; ++i)
-		{
-			total += childCumulative;
-			childCumulative *= childCount;
+	/*Event counter for state that is mostly touched by one thread at a time, such as a partition
+	  behind its lock. Readers sharing a SharedLock may bump it together, so it adds with a
+	  relaxed fetch_add and never loses a count.*/
+	struct StatCount {
+	#if FNTREE_STATS
+		std::atomic<size_t> _value{0};
+
+		void add(size_t amount = 1) {
+			_value.fetch_add(amount, std::memory_order_relaxed);
 		}
 
-		return total;
-	}
+		size_t get() const {
+			return _value.load(std::memory_order_relaxed);
+		}
+	#else
+		void add(size_t = 1) {}
 
-	constexpr size_t getBitCount(size_t childCount) {
-		if (childCount == 2) {
-			return 1;
-		} else if (childCount == 4) {
-			return 2;
-		} else if (childCount == 8) {
-			return 3;
-		} else if (childCount == 16) {
-			return 4;
-		} else if (childCount == 32) {
-			return 5;
-		} else if (childCount == 64) {
-			return 6;
-		} else if (childCount == 128) {
-			return 7;
+		size_t get() const {
+			return 0;
 		}
-		return (size_t)-1;
+	#endif
+	};
+
+	inline size_t statShard() {
+		static std::atomic<size_t> nextShard(0);
+		thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed);
+		return shard;
 	}
 
-	static size_t totalMemUsed = 0;
-	static size_t collCount = 0;
+	/*Event counter bumped by any number of threads. Each thread adds to its own cache line, the
+	  shards are only summed when the counter is read.*/
+	struct ShardedStatCount {
+	#if FNTREE_STATS
+		static constexpr size_t shardCount = 16;
 
-	template <size_t keySize, size_t childCount /*, size_t partLevel = (size_t)-1*/>
-	struct BitNode {
-		template<size_t amount, size_t bCount>
-		struct OffSetArr {
-				size_t offsets[amount] = {0};
-				constexpr OffSetArr() {
-					size_t i = amount;
-					size_t j = 0;
-					do {
-						i -= 1;
-						offsets[j] = i * bCount;
-						j += 1;
-					} while (i > 0);
-			}
+		struct alignas(64) Shard {
+			std::atomic<size_t> value{0};
 		};
 
-		BitNode() { FNTree::totalMemUsed += sizeof(BitNode);}
+		Shard _shards[shardCount];
 
-		static_assert(getBitCount(childCount) != (size_t)-1);
-		static constexpr size_t bitCount = getBitCount(childCount);
-		static_assert(keySize % bitCount == 0);
-		static constexpr size_t bitIndex = bitCount - 1;
-		static constexpr size_t bitShift = BIT_COVERS.shifts[bitIndex];
-		static constexpr OffSetArr<keySize / bitCount, bitCount> offsets;
-		static constexpr size_t offsetsSize = sizeof(offsets.offsets) / sizeof(offsets.offsets[0]);
-		static constexpr size_t bridgesSize = offsetsSize - 1;
-		void* lock = nullptr;
-		void* children[childCount] = {nullptr};
-	};
+		void add(size_t amount = 1) {
+			_shards[statShard() % shardCount].value.fetch_add(amount, std::memory_order_relaxed);
+		}
 
-	template <size_t keySize, size_t childCount>
-	void makeParitions(BitNode<keySize, childCount>* tree, size_t level) {
-		if (level == 0) {
-			tree->lock = new ParitionLock();
-			return;
+		size_t get() const {
+			size_t total = 0;
+			for (size_t i = 0; i < shardCount; ++i)
+			{
+				total += _shards[i].value.load(std::memory_order_relaxed);
+			}
+			return total;
 		}
-		for (size_t i = 0; i < childCount; ++i)
-		{
-			tree->children[i] = new BitNode<keySize, childCount>();
-			if (level > 0) {
-				makeParitions((BitNode<keySize, childCount>*)tree->children[i], level - 1);
+	#else
+		void add(size_t = 1) {}
+
+		size_t get() const {
+			return 0;
+		}
+	#endif
+	};
+
+	/*Counters of one partition, only written while its lock is held.*/
+	struct PartitionCounters {
+		StatCount lockAcquisitions;
+		StatCount lockContended;
+		StatCount lockWaitNanos;
+		StatCount hits;
+		StatCount misses;
+
+		void recordFind(const void* found) {
+			if (found != nullptr) {
+				hits.add();
+			} else {
+				misses.add();
 			}
 		}
+	};
+
+	inline void cpuRelax() {
+	#if defined(_MSC_VER)
+		_mm_pause();
+	#elif defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+	#elif defined(__aarch64__)
+		asm volatile("yield");
+	#endif
 	}
 
-	template <size_t keySize, size_t childCount>
-	void insertInto(BitNode<keySize, childCount>* tree, size_t key, void* data) {
-		BitNode<keySize, childCount>* current = tree;
-		size_t i = 0;
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			//printf("key slice is %zu\n", key >> BitNode<keySize, childCount>::offsets.offsets[i]);
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			if (current->children[shifted] == nullptr) {
-				current->children[shifted] = new BitNode<keySize, childCount>();
-			} 
-			current =  (BitNode<keySize, childCount>*)current->children[shifted];
+	/*Partition lock policies. Each one has lock, try_lock and unlock for writers and the _shared
+	  versions for lookups, which only SharedLock lets run side by side.*/
+	struct MutexLock {
+		std::mutex mux;
+
+		void lock() {
+			mux.lock();
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		current->children[shiftedLast] = data;
-	}
 
-	template <size_t keySize, size_t childCount>
-	void insertIntoPart(BitNode<keySize, childCount>* tree, size_t key, void* data, size_t levels) {
-		BitNode<keySize, childCount>* current = tree;
-		size_t i = 0;
-		for (; i < levels; ++i)
-		{
-			current = (BitNode<keySize, childCount>*)current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+		bool try_lock() {
+			return mux.try_lock();
 		}
-		// now the lock part
-		ScopedPartLock scoped((ParitionLock*)current->lock);
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			//printf("key slice is %zu\n", key >> BitNode<keySize, childCount>::offsets.offsets[i]);
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			if (current->children[shifted] == nullptr) {
-				current->children[shifted] = new BitNode<keySize, childCount>();
-			} 
-			current =  (BitNode<keySize, childCount>*)current->children[shifted];
+
+		void unlock() {
+			mux.unlock();
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		current->children[shiftedLast] = data;
-	}
 
-	template <size_t keySize, size_t childCount>
-	void insertHash(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
-		BitNode<keySize, childCount>* current = tree;
-		size_t i = 0;
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			//printf("key slice is %zu\n", key >> BitNode<keySize, childCount>::offsets.offsets[i]);
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			//printf("slice %zu ", shifted);
-			if (current->children[shifted] == nullptr) {
-				current->children[shifted] = new BitNode<keySize, childCount>();
-			} 
-			current =  (BitNode<keySize, childCount>*)current->children[shifted];
+		void lock_shared() {
+			lock();
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		//printf("slice %zu\n", shiftedLast);
-		KeyValueSpot* gotkv = (KeyValueSpot*)current->children[shiftedLast];
-		if (gotkv == nullptr) {
-			KeyValueSpot* newkvs = new KeyValueSpot();
-			newkvs->kvp = kvp;
-			current->children[shiftedLast] = newkvs;
-		} else {
-			FNTree::collCount += 1;
-			while (gotkv != nullptr) {
-				if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
-					gotkv->kvp->value = kvp->value;
-					return;
-				}
-				gotkv = gotkv->next;
-			}
-			KeyValueSpot* newkvs = new KeyValueSpot();
-			newkvs->kvp = kvp;
-			gotkv = (KeyValueSpot*)current->children[shiftedLast];
-			newkvs->next = gotkv;
-			current->children[shiftedLast] = newkvs;
+
+		bool try_lock_shared() {
+			return try_lock();
 		}
-	}
 
-	template <size_t keySize, size_t childCount>
-	void insertHashPart(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels) {
-		BitNode<keySize, childCount>* current = tree;
-		size_t i = 0;
-		for (; i < levels; ++i)
-		{
-			current = (BitNode<keySize, childCount>*)current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+		void unlock_shared() {
+			unlock();
 		}
-		// now the lock part
-		ScopedPartLock scoped((ParitionLock*)current->lock);
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			//printf("key slice is %zu\n", key >> BitNode<keySize, childCount>::offsets.offsets[i]);
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			//printf("slice %zu ", shifted);
-			if (current->children[shifted] == nullptr) {
-				current->children[shifted] = new BitNode<keySize, childCount>();
-			} 
-			current =  (BitNode<keySize, childCount>*)current->children[shifted];
+	};
+
+	/*Test and test-and-set spinlock. Waiters spin on a plain load with exponential backoff, and
+	  yield the thread once the backoff is at its cap.*/
+	struct SpinLock {
+		static constexpr unsigned maxBackoff = 1024;
+		std::atomic<bool> held{false};
+
+		bool try_lock() {
+			return !held.load(std::memory_order_relaxed) && !held.exchange(true, std::memory_order_acquire);
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		//printf("slice %zu\n", shiftedLast);
-		KeyValueSpot* gotkv = (KeyValueSpot*)current->children[shiftedLast];
-		if (gotkv == nullptr) {
-			KeyValueSpot* newkvs = new KeyValueSpot();
-			newkvs->kvp = kvp;
-			current->children[shiftedLast] = newkvs;
-		} else {
-			FNTree::collCount += 1;
-			while (gotkv != nullptr) {
-				if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
-					gotkv->kvp->value = kvp->value;
-					return;
+
+		void lock() {
+			unsigned backoff = 1;
+			while (!try_lock()) {
+				while (held.load(std::memory_order_relaxed)) {
+					if (backoff < maxBackoff) {
+						for (unsigned i = 0; i < backoff; ++i)
+						{
+							cpuRelax();
+						}
+						backoff *= 2;
+					} else {
+						std::this_thread::yield();
+					}
 				}
-				gotkv = gotkv->next;
 			}
-			KeyValueSpot* newkvs = new KeyValueSpot();
-			newkvs->kvp = kvp;
-			gotkv = (KeyValueSpot*)current->children[shiftedLast];
-			newkvs->next = gotkv;
-			current->children[shiftedLast] = newkvs;
 		}
-	}
 
-	template <size_t keySize, size_t childCount>
-	void* findInto(BitNode<keySize, childCount>* tree, size_t key) {
-		BitNode<keySize, childCount>* current = tree;
-		//printf("FIND offsetsize is %zu\n", BitNode<keySize, childCount>::offsetsSize);
-		size_t i = 0;
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			if (current->children[shifted] == nullptr) {
-				return nullptr;
+		void unlock() {
+			held.store(false, std::memory_order_release);
+		}
+
+		void lock_shared() {
+			lock();
+		}
+
+		bool try_lock_shared() {
+			return try_lock();
+		}
+
+		void unlock_shared() {
+			unlock();
+		}
+	};
+
+	/*Readers share the partition, writers have it alone.*/
+	struct SharedLock {
+		std::shared_mutex mux;
+
+		void lock() {
+			mux.lock();
+		}
+
+		bool try_lock() {
+			return mux.try_lock();
+		}
+
+		void unlock() {
+			mux.unlock();
+		}
+
+		void lock_shared() {
+			mux.lock_shared();
+		}
+
+		bool try_lock_shared() {
+			return mux.try_lock_shared();
+		}
+
+		void unlock_shared() {
+			mux.unlock_shared();
+		}
+	};
+
+	template <class Lock = MutexLock>
+	struct ParitionLock {
+		Lock mux;
+		PartitionCounters counters;
+		static constexpr uint32_t contentionWindow = 1 << 14;
+		// contended acquisitions, decaying, kept even without FNTREE_STATS since it decides partition splits
+		std::atomic<uint32_t> contention{0};
+		// acquisitions, every contentionWindow of them halves contention
+		std::atomic<uint32_t> acquired{0};
+		// bumped by every writer before it lets go, front caches compare it to what they saw
+		std::atomic<uint64_t> version{0};
+
+		/*Only called with the lock held for writing.*/
+		void bumpVersion() {
+			version.store(version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		}
+
+		void noteAcquired() {
+			counters.lockAcquisitions.add();
+			if ((acquired.fetch_add(1, std::memory_order_relaxed) + 1) % contentionWindow == 0) {
+				contention.fetch_sub(contention.load(std::memory_order_relaxed) / 2, std::memory_order_relaxed);
 			}
-			current = (BitNode<keySize, childCount>*)current->children[shifted];
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		return current->children[shiftedLast];
-	}
 
-	template <size_t keySize, size_t childCount>
-	void* findIntoPart(BitNode<keySize, childCount>* tree, size_t key, size_t levels) {
-		BitNode<keySize, childCount>* current = tree;
-		//printf("FIND offsetsize is %zu\n", BitNode<keySize, childCount>::offsetsSize);
-		size_t i = 0;
-		for (; i < levels; ++i)
-		{
-			current = (BitNode<keySize, childCount>*)current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+		void noteContended() {
+			contention.fetch_add(1, std::memory_order_relaxed);
 		}
-		// now the lock part
-		ScopedPartLock scoped((ParitionLock*)current->lock);
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			if (current->children[shifted] == nullptr) {
-				return nullptr;
+
+		void lock() {
+			if (!mux.try_lock()) {
+			#if FNTREE_STATS
+				// the clock is only read when the lock is taken
+				auto start = std::chrono::steady_clock::now();
+				mux.lock();
+				counters.lockContended.add();
+				counters.lockWaitNanos.add((size_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			#else
+				mux.lock();
+			#endif
+				noteContended();
 			}
-			current = (BitNode<keySize, childCount>*)current->children[shifted];
+			noteAcquired();
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		return current->children[shiftedLast];
-	}
 
-	template <size_t keySize, size_t childCount>
-	void* findHash(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
-		BitNode<keySize, childCount>* current = tree;
-		//printf("FIND offsetsize is %zu\n", BitNode<keySize, childCount>::offsetsSize);
-		size_t i = 0;
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			if (current->children[shifted] == nullptr) {
-				return nullptr;
+		/*Takes the lock only if it is free, a miss still counts as contention.*/
+		bool tryLock() {
+			if (!mux.try_lock()) {
+				noteContended();
+				return false;
 			}
-			current = (BitNode<keySize, childCount>*)current->children[shifted];
+			noteAcquired();
+			return true;
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		KeyValueSpot* gotkv = (KeyValueSpot*)current->children[shiftedLast];
-		while (gotkv != nullptr) {
-			if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
-				return gotkv->kvp->value;
+
+		void unlock() {
+			mux.unlock();
+		}
+
+		void lockShared() {
+			if (!mux.try_lock_shared()) {
+			#if FNTREE_STATS
+				auto start = std::chrono::steady_clock::now();
+				mux.lock_shared();
+				counters.lockContended.add();
+				counters.lockWaitNanos.add((size_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+			#else
+				mux.lock_shared();
+			#endif
+				noteContended();
 			}
-			gotkv = gotkv->next;
+			noteAcquired();
 		}
-		return nullptr;
-	}
 
-	template <size_t keySize, size_t childCount>
-	void* findHashPart(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels) {
-		BitNode<keySize, childCount>* current = tree;
-		//printf("FIND offsetsize is %zu\n", BitNode<keySize, childCount>::offsetsSize);
-		size_t i = 0;
-		for (; i < levels; ++i)
-		{
-			current = (BitNode<keySize, childCount>*)current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+		void unlockShared() {
+			mux.unlock_shared();
 		}
-		// now the lock part
-		ScopedPartLock scoped((ParitionLock*)current->lock);
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+	};
+
+	template <class Part>
+	struct ScopedPartLock {
+		ScopedPartLock(Part* ptl):_ptl(ptl) {
+			_ptl->lock();
+		}
+
+		ScopedPartLock(Part* ptl, std::adopt_lock_t):_ptl(ptl) {}
+
+		// every write lock counts as a write
+		~ScopedPartLock() {
+			_ptl->bumpVersion();
+			_ptl->unlock();
+		}
+
+		Part* _ptl;
+	};
+
+	/*Holds a partition for a lookup.*/
+	template <class Part>
+	struct ScopedPartReadLock {
+		ScopedPartReadLock(Part* ptl):_ptl(ptl) {
+			_ptl->lockShared();
+		}
+
+		ScopedPartReadLock(Part* ptl, std::adopt_lock_t):_ptl(ptl) {}
+
+		~ScopedPartReadLock() {
+			_ptl->unlockShared();
+		}
+
+		Part* _ptl;
+	};
+
+	/*Default node allocator, every node is its own new and the tree frees them one by one on teardown.*/
+	struct HeapAllocator {
+		static constexpr bool ownsMemory = false;
+
+		void* allocate(size_t size, size_t /*align*/) {
+			return ::operator new(size);
+		}
+
+		void recycle(void* ptr, size_t /*size*/, size_t /*align*/) {
+			::operator delete(ptr);
+		}
+
+		template <class T>
+		T* make() {
+			return new T();
+		}
+
+		template <class T>
+		void drop(T* ptr) {
+			delete ptr;
+		}
+
+		void absorb(HeapAllocator& /*other*/) {}
+
+		void reserve(size_t /*bytes*/) {}
+
+		void swap(HeapAllocator& /*other*/) {}
+	};
+
+	/*How many of a slab allocator's bytes sit on huge pages. Explicit pages come from the
+	  hugetlb pool, transparent ones are what the kernel reports having promoted.*/
+	struct HugePageReport {
+		size_t slabBytes = 0;
+		size_t explicitPages = 0;
+		size_t transparentPages = 0;
+
+		void merge(const HugePageReport& other) {
+			slabBytes += other.slabBytes;
+			explicitPages += other.explicitPages;
+			transparentPages += other.transparentPages;
+		}
+	};
+
+	/*Start and length of each slab an allocator holds.*/
+	typedef std::vector<std::pair<uintptr_t, size_t>> SlabRanges;
+
+	/*Where a slab allocator gets its slabs from. map may round size up to what it handed out,
+	  and throws std::bad_alloc when it has nothing to hand out.*/
+	struct MallocSlabs {
+		static constexpr size_t firstSlab = 4096;
+		static constexpr size_t maxSlab = 256 * 1024;
+
+		static void* mallocSlab(size_t size) {
+			void* mem = std::malloc(size);
+			if (mem == nullptr) {
+				throw std::bad_alloc();
+			}
+			return mem;
+		}
+
+		void* map(size_t& size) {
+			return mallocSlab(size);
+		}
+
+		void unmap(void* ptr, size_t /*size*/) {
+			std::free(ptr);
+		}
+
+		static HugePageReport hugePages(const SlabRanges& /*ranges*/) {
+			return HugePageReport();
+		}
+	};
+
+	/*Slabs of whole 2 MB pages once an allocator has grown past its first huge page, smaller ones
+	  come from malloc so the many small partitions of a map do not each pin a huge page. A huge
+	  slab is first asked of the hugetlb pool with MAP_HUGETLB, and once the pool has said no,
+	  mapped with regular pages and advised with MADV_HUGEPAGE so the kernel can back it with
+	  transparent huge pages. Without mmap every slab comes from malloc.*/
+	struct HugePageSlabs {
+		static constexpr size_t hugePage = 2 * 1024 * 1024;
+		static constexpr size_t firstSlab = 64 * 1024;
+		static constexpr size_t maxSlab = 32 * hugePage;
+		bool _poolEmpty = false;
+
+		void* map(size_t& size) {
+			if (size < hugePage) {
+				return MallocSlabs::mallocSlab(size);
+			}
+			size = (size + hugePage - 1) & ~(hugePage - 1);
+		#if defined(FNTREE_HAS_MMAP)
+		#if defined(MAP_HUGETLB)
+			if (!_poolEmpty) {
+				void* mem = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+				if (mem != MAP_FAILED) {
+					return mem;
+				}
+				_poolEmpty = true;
+			}
+		#endif
+			// mmap only aligns to pages, a huge page needs the mapping aligned to its size
+			void* mapped = ::mmap(nullptr, size + hugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (mapped == MAP_FAILED) {
+				throw std::bad_alloc();
+			}
+			uintptr_t start = (uintptr_t)mapped;
+			uintptr_t aligned = (start + hugePage - 1) & ~(uintptr_t)(hugePage - 1);
+			if (aligned != start) {
+				::munmap(mapped, aligned - start);
+			}
+			if (start + hugePage != aligned) {
+				::munmap((void*)(aligned + size), start + hugePage - aligned);
+			}
+			void* mem = (void*)aligned;
+		#if defined(MADV_HUGEPAGE)
+			::madvise(mem, size, MADV_HUGEPAGE);
+		#endif
+			return mem;
+		#else
+			return MallocSlabs::mallocSlab(size);
+		#endif
+		}
+
+		void unmap(void* ptr, size_t size) {
+		#if defined(FNTREE_HAS_MMAP)
+			if (size >= hugePage) {
+				::munmap(ptr, size);
+				return;
+			}
+			std::free(ptr);
+		#else
+			(void)size;
+			std::free(ptr);
+		#endif
+		}
+
+		/*Reads the huge pages under the slabs out of /proc/self/smaps. A mapping the kernel merged
+		  with a neighbour is counted in proportion to its overlap with the slabs.*/
+		static HugePageReport hugePages(const SlabRanges& ranges) {
+			HugePageReport report;
+		#if defined(__linux__)
+			FILE* smaps = std::fopen("/proc/self/smaps", "r");
+			if (smaps == nullptr) {
+				return report;
+			}
+			char line[256];
+			size_t overlap = 0;
+			size_t length = 0;
+			while (std::fgets(line, sizeof(line), smaps) != nullptr) {
+				unsigned long long start = 0;
+				unsigned long long end = 0;
+				size_t kb = 0;
+				if (std::sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+					overlap = 0;
+					length = (size_t)(end - start);
+					for (const std::pair<uintptr_t, size_t>& range : ranges) {
+						uintptr_t from = range.first > start ? range.first : (uintptr_t)start;
+						uintptr_t to = range.first + range.second < end ? range.first + range.second : (uintptr_t)end;
+						overlap += to > from ? to - from : 0;
+					}
+				} else if (overlap == 0) {
+					continue;
+				} else if (std::sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+					report.transparentPages += (size_t)((double)kb * 1024 * ((double)overlap / (double)length) / hugePage);
+				} else if (std::sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1) {
+					report.explicitPages += (size_t)((double)kb * 1024 * ((double)overlap / (double)length) / hugePage);
+				}
+			}
+			std::fclose(smaps);
+		#endif
+			return report;
+		}
+	};
+
+	/*Bump allocates nodes out of geometrically growing slabs and keeps a free list per node size and
+	  alignment, so dropped nodes are reused by later inserts that need the same. Destroying the allocator releases every slab at
+	  once, the tree never has to walk its nodes. Source provides the slabs.*/
+	template <class Source = MallocSlabs>
+	struct BasicSlabAllocator {
+		static constexpr bool ownsMemory = true;
+		static constexpr size_t firstSlab = Source::firstSlab;
+		static constexpr size_t maxSlab = Source::maxSlab;
+		static constexpr size_t freeListCount = 8;
+
+		struct Slab {
+			Slab* next;
+			size_t size;
+		};
+
+		struct FreeNode {
+			FreeNode* next;
+		};
+
+		struct FreeList {
+			size_t size = 0;
+			size_t align = 0;
+			FreeNode* head = nullptr;
+		};
+
+		Slab* _slabs = nullptr;
+		char* _bump = nullptr;
+		char* _end = nullptr;
+		size_t _nextSlab = firstSlab;
+		FreeList _free[freeListCount];
+
+		typedef Source SlabSource;
+		Source _source;
+
+		BasicSlabAllocator() {}
+		BasicSlabAllocator(const BasicSlabAllocator&) = delete;
+		BasicSlabAllocator& operator=(const BasicSlabAllocator&) = delete;
+
+		~BasicSlabAllocator() {
+			release();
+		}
+
+		void release() {
+			while (_slabs != nullptr) {
+				Slab* next = _slabs->next;
+				_source.unmap(_slabs, _slabs->size);
+				_slabs = next;
+			}
+			_bump = nullptr;
+			_end = nullptr;
+			_nextSlab = firstSlab;
+			for (size_t i = 0; i < freeListCount; ++i)
+			{
+				_free[i] = FreeList();
+			}
+		}
+
+		void grow(size_t need) {
+			size_t size = _nextSlab;
+			while (size < need + sizeof(Slab)) {
+				size *= 2;
+			}
+			if (_nextSlab < maxSlab) {
+				_nextSlab *= 2;
+			}
+			addSlab(size);
+		}
+
+		void addSlab(size_t size) {
+			Slab* slab = (Slab*)_source.map(size);
+			slab->next = _slabs;
+			slab->size = size;
+			_slabs = slab;
+			_bump = (char*)(slab + 1);
+			_end = (char*)slab + size;
+		}
+
+		void* allocate(size_t size, size_t align) {
+			for (size_t i = 0; i < freeListCount; ++i)
+			{
+				if (_free[i].size == size && _free[i].align == align && _free[i].head != nullptr) {
+					FreeNode* got = _free[i].head;
+					_free[i].head = got->next;
+					return got;
+				}
+			}
+			char* at = (char*)(((uintptr_t)_bump + align - 1) & ~(uintptr_t)(align - 1));
+			if (_bump == nullptr || at + size > _end) {
+				grow(size + align);
+				at = (char*)(((uintptr_t)_bump + align - 1) & ~(uintptr_t)(align - 1));
+			}
+			_bump = at + size;
+			return at;
+		}
+
+		/*ptr has to come from allocate(size, align), a block is only handed out again for the same
+		  size and alignment.*/
+		void recycle(void* ptr, size_t size, size_t align) {
+			for (size_t i = 0; i < freeListCount; ++i)
+			{
+				if ((_free[i].size == size && _free[i].align == align) || _free[i].size == 0) {
+					_free[i].size = size;
+					_free[i].align = align;
+					FreeNode* node = (FreeNode*)ptr;
+					node->next = _free[i].head;
+					_free[i].head = node;
+					return;
+				}
+			}
+			// more node kinds than free lists, the memory comes back when the slabs are released
+		}
+
+		/*Makes sure the next bytes of allocations come out of one slab, back to back. The slab is
+		  sized to fit, with no room to spare.*/
+		void reserve(size_t bytes) {
+			if (_bump == nullptr || (size_t)(_end - _bump) < bytes) {
+				addSlab(bytes + sizeof(Slab) + alignof(std::max_align_t));
+			}
+		}
+
+		/*Bytes held in slabs, live or not.*/
+		size_t footprint() const {
+			size_t total = 0;
+			for (Slab* slab = _slabs; slab != nullptr; slab = slab->next) {
+				total += slab->size;
+			}
+			return total;
+		}
+
+		void slabRanges(SlabRanges& out) const {
+			for (Slab* slab = _slabs; slab != nullptr; slab = slab->next) {
+				out.emplace_back((uintptr_t)slab, slab->size);
+			}
+		}
+
+		HugePageReport hugePages() const {
+			SlabRanges ranges;
+			slabRanges(ranges);
+			HugePageReport report = Source::hugePages(ranges);
+			report.slabBytes = footprint();
+			return report;
+		}
+
+		void swap(BasicSlabAllocator& other) {
+			std::swap(_source, other._source);
+			std::swap(_slabs, other._slabs);
+			std::swap(_bump, other._bump);
+			std::swap(_end, other._end);
+			std::swap(_nextSlab, other._nextSlab);
+			std::swap(_free, other._free);
+		}
+
+		/*Takes over every slab of other, so nodes it handed out now live as long as this allocator.*/
+		void absorb(BasicSlabAllocator& other) {
+			Slab* last = other._slabs;
+			if (last == nullptr) {
+				return;
+			}
+			while (last->next != nullptr) {
+				last = last->next;
+			}
+			last->next = _slabs;
+			_slabs = other._slabs;
+			other._slabs = nullptr;
+			other.release();
+		}
+
+		template <class T>
+		T* make() {
+			static_assert(sizeof(T) >= sizeof(FreeNode));
+			return new (allocate(sizeof(T), alignof(T))) T();
+		}
+
+		template <class T>
+		void drop(T* ptr) {
+			ptr->~T();
+			recycle(ptr, sizeof(T), alignof(T));
+		}
+	};
+
+	typedef BasicSlabAllocator<> SlabAllocator;
+
+	/*Opt in node storage on huge pages, for trees large enough that TLB misses dominate lookups.
+	  Every tree that takes an Alloc accepts it, such as BasicMapObj<HugePageAllocator>.*/
+	typedef BasicSlabAllocator<HugePageSlabs> HugePageAllocator;
+
+	inline unsigned lowestSetBit(uint64_t bits) {
+	#if defined(_MSC_VER)
+		unsigned long index;
+		_BitScanForward64(&index, bits);
+		return (unsigned)index;
+	#else
+		return (unsigned)__builtin_ctzll(bits);
+	#endif
+	}
+
+	inline unsigned popCount(uint64_t bits) {
+	#if defined(_MSC_VER)
+		return (unsigned)__popcnt64(bits);
+	#else
+		return (unsigned)__builtin_popcountll(bits);
+	#endif
+	}
+
+	inline void prefetchRead(const void* ptr) {
+	#if defined(_MSC_VER)
+		_mm_prefetch((const char*)ptr, _MM_HINT_T0);
+	#else
+		__builtin_prefetch(ptr, 0, 3);
+	#endif
+	}
+
+	/*Leaf of a hashed tree that keeps keys and values inline. It replaces the last BitNode level and
+	  its KeyValueSpot chains: one tag byte per entry lives in the first cache line, all tags are
+	  compared at once with SWAR byte matching, and a hit is confirmed on the line holding the entry.*/
+	struct alignas(64) LeafBucket {
+		static constexpr size_t slotCount = 7;
+		static constexpr uint64_t slotBytes = 0x00FFFFFFFFFFFFFFULL;
+		static constexpr uint64_t lowBits = 0x0101010101010101ULL;
+		static constexpr uint64_t highBits = 0x8080808080808080ULL;
+
+		struct Entry {
+			unsigned char key[16];
+			void* value;
+		};
+
+		// byte i is the tag of entries[i], 0 means the entry is empty
+		uint64_t tags = 0;
+		LeafBucket* overflow = nullptr;
+		Entry entries[slotCount];
+
+		static uint8_t tagOf(size_t hash) {
+			// the tree consumes the low bits of the hash, tags come from the top
+			return (uint8_t)((hash >> 57) | 0x80);
+		}
+
+		// high bit set in every byte of tags equal to tag, may also flag a byte above a real match
+		static uint64_t matchTags(uint64_t tags, uint8_t tag) {
+			uint64_t x = tags ^ (lowBits * tag);
+			return (x - lowBits) & ~x & highBits & slotBytes;
+		}
+
+		Entry* match(uint8_t tag, const unsigned char* key) {
+			uint64_t hits = matchTags(tags, tag);
+			while (hits != 0) {
+				Entry* got = &entries[lowestSetBit(hits) / 8];
+				if (std::memcmp(got->key, key, sizeof(got->key)) == 0) {
+					return got;
+				}
+				hits &= hits - 1;
+			}
+			return nullptr;
+		}
+	};
+
+	static_assert(sizeof(LeafBucket) == 192);
+
+	template <class Alloc>
+	void putBucket(void** slot, size_t hash, KeyValuePair* kvp, Alloc& alloc) {
+		uint8_t tag = LeafBucket::tagOf(hash);
+		LeafBucket* open = nullptr;
+		for (LeafBucket* bucket = (LeafBucket*)*slot; bucket != nullptr; bucket = bucket->overflow) {
+			LeafBucket::Entry* got = bucket->match(tag, kvp->key);
+			if (got != nullptr) {
+				got->value = kvp->value;
+				return;
+			}
+			if (open == nullptr && LeafBucket::matchTags(bucket->tags, 0) != 0) {
+				open = bucket;
+			}
+		}
+		if (open == nullptr) {
+			open = alloc.template make<LeafBucket>();
+			open->overflow = (LeafBucket*)*slot;
+			*slot = open;
+		}
+		// the lowest flagged byte of a zero match is always a real empty entry
+		size_t at = lowestSetBit(LeafBucket::matchTags(open->tags, 0)) / 8;
+		std::memcpy(open->entries[at].key, kvp->key, sizeof(kvp->key));
+		open->entries[at].value = kvp->value;
+		open->tags |= (uint64_t)tag << (at * 8);
+	}
+
+	inline void* getBucket(void* slot, size_t hash, KeyValuePair* kvp) {
+		uint8_t tag = LeafBucket::tagOf(hash);
+		for (LeafBucket* bucket = (LeafBucket*)slot; bucket != nullptr; bucket = bucket->overflow) {
+			LeafBucket::Entry* got = bucket->match(tag, kvp->key);
+			if (got != nullptr) {
+				return got->value;
+			}
+		}
+		return nullptr;
+	}
+
+	/*A write posted to a partition for whichever thread holds its lock. key is written before
+	  request is published, and the holder clears request once the write is in. Every slot has a
+	  cache line to itself, so posters spinning on their own slot do not share one.*/
+	struct alignas(64) CombineSlot {
+		std::atomic<void*> request{nullptr};
+		size_t key = 0;
+	};
+
+	/*A partition owns its own allocator, nodes below it are only created while holding its lock.
+	  States start on a cache line of their own, so no two partition locks share one. A split
+	  partition hands its keys to the child partitions below it and is only passed through.*/
+	template <class Alloc, class Lock = MutexLock>
+	struct alignas(64) PartitionState : ParitionLock<Lock> {
+		static constexpr size_t combineSlots = 8;
+		std::atomic<bool> split{false};
+		Alloc alloc;
+		// publication array of the combining write path, made by the first write posted here
+		std::atomic<CombineSlot*> slots{nullptr};
+
+		PartitionState() {}
+		PartitionState(const PartitionState&) = delete;
+		PartitionState& operator=(const PartitionState&) = delete;
+
+		~PartitionState() {
+			delete[] slots.load(std::memory_order_relaxed);
+		}
+
+		/*The publication array, made on first use so partitions that never combine go without.*/
+		CombineSlot* combineSlotArray() {
+			CombineSlot* got = slots.load(std::memory_order_acquire);
+			if (got != nullptr) {
+				return got;
+			}
+			CombineSlot* made = new CombineSlot[combineSlots];
+			if (slots.compare_exchange_strong(got, made, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				return made;
+			}
+			delete[] made;
+			return got;
+		}
+	};
+
+	/*Contention a partition has to build up before it splits. Contention halves every
+	  contentionWindow acquisitions, so this is reached at roughly one contended acquisition in
+	  thirty two, not by a partition that is only busy for long.*/
+	constexpr uint32_t defaultSplitThreshold = 1024;
+
+	/*Everything a partitioned tree needs to grow. Partition nodes are created on the first insert
+	  below them and their states come out of contiguous chunks, both under growMux. alloc builds
+	  the nodes above the partitions. A partition above splitDepth whose lock saw splitThreshold
+	  contention is split by the next writer, 0 turns splitting off.*/
+	template <class Alloc, class Lock = MutexLock>
+	struct PartitionTable {
+		static constexpr size_t chunkSize = 64;
+		std::vector<std::unique_ptr<PartitionState<Alloc, Lock>[]>> chunks;
+		size_t used = 0;
+		std::mutex growMux;
+		Alloc* alloc = nullptr;
+		uint32_t splitThreshold = 0;
+		size_t splitDepth = 0;
+
+		PartitionState<Alloc, Lock>* next() {
+			if (used % chunkSize == 0) {
+				chunks.emplace_back(new PartitionState<Alloc, Lock>[chunkSize]);
+			}
+			return &chunks.back()[used++ % chunkSize];
+		}
+	};
+
+	/*Read locks a group of partitions in address order, so batches never deadlock each other and
+	  a partition hit by several keys of the group is only locked once. Null states are skipped.*/
+	template <class Alloc, class Lock = MutexLock>
+	struct ScopedPartGroupLock {
+		static constexpr size_t maxGroup = 16;
+		PartitionState<Alloc, Lock>* _held[maxGroup];
+		size_t _count = 0;
+
+		ScopedPartGroupLock() {}
+
+		ScopedPartGroupLock(PartitionState<Alloc, Lock>* const* states, size_t n) {
+			acquire(states, n);
+		}
+
+		~ScopedPartGroupLock() {
+			release();
+		}
+
+		void acquire(PartitionState<Alloc, Lock>* const* states, size_t n) {
+			for (size_t i = 0; i < n; ++i)
+			{
+				if (states[i] == nullptr) {
+					continue;
+				}
+				size_t at = 0;
+				while (at < _count && _held[at] < states[i]) {
+					at += 1;
+				}
+				if (at < _count && _held[at] == states[i]) {
+					continue;
+				}
+				std::memmove(&_held[at + 1], &_held[at], (_count - at) * sizeof(_held[0]));
+				_held[at] = states[i];
+				_count += 1;
+			}
+			for (size_t i = 0; i < _count; ++i)
+			{
+				_held[i]->lockShared();
+			}
+		}
+
+		void release() {
+			for (size_t i = _count; i > 0; --i)
+			{
+				_held[i - 1]->unlockShared();
+			}
+			_count = 0;
+		}
+	};
+
+	constexpr size_t getBitCount(size_t childCount) {
+		if (childCount == 2) {
+			return 1;
+		} else if (childCount == 4) {
+			return 2;
+		} else if (childCount == 8) {
+			return 3;
+		} else if (childCount == 16) {
+			return 4;
+		} else if (childCount == 32) {
+			return 5;
+		} else if (childCount == 64) {
+			return 6;
+		} else if (childCount == 128) {
+			return 7;
+		}
+		return (size_t)-1;
+	}
+
+	template <size_t keySize, size_t childCount /*, size_t partLevel = (size_t)-1*/>
+	struct BitNode {
+		template<size_t amount, size_t bCount>
+		struct OffSetArr {
+				size_t offsets[amount] = {0};
+				constexpr OffSetArr() {
+					size_t i = amount;
+					size_t j = 0;
+					do {
+						i -= 1;
+						offsets[j] = i * bCount;
+						j += 1;
+					} while (i > 0);
+			}
+		};
+
+		static_assert(getBitCount(childCount) != (size_t)-1);
+		static constexpr size_t bitCount = getBitCount(childCount);
+		static_assert(keySize % bitCount == 0);
+		static constexpr size_t bitIndex = bitCount - 1;
+		static constexpr size_t bitShift = BIT_COVERS.shifts[bitIndex];
+		static constexpr OffSetArr<keySize / bitCount, bitCount> offsets{};
+		static constexpr size_t offsetsSize = sizeof(offsets.offsets) / sizeof(offsets.offsets[0]);
+		static constexpr size_t bridgesSize = offsetsSize - 1;
+		void* lock = nullptr;
+		void* children[childCount] = {nullptr};
+	};
+
+	/*Bitmap compressed BitNode. Only the children that exist are stored, packed in slot order right
+	  after the header, and a child's position is the popcount of the bitmap below its slot. The
+	  array doubles in place of the old node when it fills up.*/
+	template <size_t keySize, size_t childCount>
+	struct CompactBitNode {
+		static_assert(childCount <= 64);
+		uint64_t bitmap = 0;
+		uint32_t capacity = 0;
+
+		static size_t bytesFor(size_t capacity) {
+			return sizeof(CompactBitNode) + capacity * sizeof(void*);
+		}
+
+		template <class Alloc>
+		static CompactBitNode* make(size_t capacity, Alloc& alloc) {
+			size_t bytes = bytesFor(capacity);
+			CompactBitNode* node = new (alloc.allocate(bytes, alignof(CompactBitNode))) CompactBitNode();
+			node->capacity = (uint32_t)capacity;
+			return node;
+		}
+
+		template <class Alloc>
+		static void drop(CompactBitNode* node, Alloc& alloc) {
+			alloc.recycle(node, bytesFor(node->capacity), alignof(CompactBitNode));
+		}
+
+		void** slots() {
+			return (void**)(this + 1);
+		}
+
+		void* get(size_t index) {
+			uint64_t bit = 1ULL << index;
+			if ((bitmap & bit) == 0) {
+				return nullptr;
+			}
+			return slots()[popCount(bitmap & (bit - 1))];
+		}
+	};
+
+	/*BitNode with 32 bit children that index into the SlimStore of its tree instead of pointing
+	  anywhere. 0 is empty and a reference with slimLeafTag set names a value node in an index, or
+	  a leaf entry in a map, instead of another SlimBitNode.*/
+	template <size_t keySize, size_t childCount>
+	struct SlimBitNode {
+		uint32_t children[childCount] = {0};
+	};
+
+	static constexpr uint32_t slimLeafTag = 0x80000000u;
+
+	/*Chained leaf entry of a slim map.*/
+	struct SlimLeaf {
+		void* value;
+		uint32_t next;
+	};
+
+	/*Nodes and leaf entries of a slim tree. They live in arrays addressed by index, so the whole
+	  tree can be moved or written out as is. The root is node 0 and leaf 0 ends a chain, and the
+	  tag bit leaves room for 2^31 of each, past that the make functions throw std::length_error.
+	  The last level of an index keeps full pointers in value nodes, so a lookup touches no more
+	  cache lines than it would in a BitNode tree.*/
+	template <size_t keySize, size_t childCount>
+	struct SlimStore {
+		struct ValueNode {
+			void* values[childCount] = {nullptr};
+		};
+
+		std::vector<SlimBitNode<keySize, childCount>> nodes;
+		std::vector<ValueNode> values;
+		std::vector<SlimLeaf> leaves;
+
+		SlimStore() : nodes(1), leaves(1) {}
+
+		/*An index of size would run into the tag bit.*/
+		static void checkIndex(size_t size) {
+			if (size >= slimLeafTag) {
+				throw std::length_error("SlimStore holds at most 2^31 nodes, value nodes or leaves");
+			}
+		}
+
+		uint32_t makeNode() {
+			checkIndex(nodes.size());
+			nodes.emplace_back();
+			return (uint32_t)(nodes.size() - 1);
+		}
+
+		uint32_t makeValues() {
+			checkIndex(values.size());
+			values.emplace_back();
+			return (uint32_t)(values.size() - 1) | slimLeafTag;
+		}
+
+		uint32_t makeLeaf(void* value, uint32_t next) {
+			checkIndex(leaves.size());
+			leaves.push_back(SlimLeaf{value, next});
+			return (uint32_t)(leaves.size() - 1) | slimLeafTag;
+		}
+
+		SlimLeaf& leaf(uint32_t ref) {
+			return leaves[ref & ~slimLeafTag];
+		}
+	};
+
+	/*Same layout as BitNode, but every child slot is atomic so lock-free readers can walk it.*/
+	template <size_t keySize, size_t childCount>
+	struct AtomicBitNode {
+		std::atomic<void*> children[childCount] = {};
+	};
+
+	/*Marks a slot of a node that is being unlinked, readers treat it as empty and writers retry from the root.*/
+	struct FrozenSlot {};
+	inline FrozenSlot FROZEN_SLOT;
+
+	struct RetiredPtr {
+		void* ptr;
+		void (*deleter)(void*);
+	};
+
+	template <class T>
+	void deleteRetired(void* ptr) {
+		delete (T*)ptr;
+	}
+
+	struct EpochRecord {
+		// (epoch << 1) | 1 while the owning thread is inside a guard, 0 otherwise
+		std::atomic<size_t> state{0};
+		std::atomic<bool> inUse{false};
+		size_t depth = 0;
+		size_t retireCount = 0;
+		size_t limboEpoch[3] = {0};
+		std::vector<RetiredPtr> limbo[3];
+		EpochRecord* next = nullptr;
+	};
+
+	/*Epoch based reclamation shared by the lock-free trees. Memory retired in epoch e is freed
+	  once the global epoch reaches e + 2, which means every thread that could still see it has left.*/
+	struct Epoch {
+		static constexpr size_t retireBatch = 64;
+		static inline std::atomic<size_t> global{3};
+		static inline std::atomic<EpochRecord*> records{nullptr};
+
+		struct Handle {
+			EpochRecord* rec = nullptr;
+			~Handle() {
+				// pending limbo lists stay with the record and get freed by the next thread that adopts it
+				if (rec != nullptr) {
+					rec->inUse.store(false, std::memory_order_release);
+				}
+			}
+		};
+
+		static EpochRecord* acquireRecord() {
+			for (EpochRecord* rec = records.load(std::memory_order_acquire); rec != nullptr; rec = rec->next) {
+				bool expected = false;
+				if (!rec->inUse.load(std::memory_order_relaxed) &&
+				    rec->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+					return rec;
+				}
+			}
+			EpochRecord* rec = new EpochRecord();
+			rec->inUse.store(true, std::memory_order_relaxed);
+			EpochRecord* head = records.load(std::memory_order_relaxed);
+			do {
+				rec->next = head;
+			} while (!records.compare_exchange_weak(head, rec, std::memory_order_release, std::memory_order_relaxed));
+			return rec;
+		}
+
+		static EpochRecord* local() {
+			static thread_local Handle handle;
+			if (handle.rec == nullptr) {
+				handle.rec = acquireRecord();
+			}
+			return handle.rec;
+		}
+
+		static void enter() {
+			EpochRecord* rec = local();
+			if (rec->depth++ == 0) {
+				rec->state.store((global.load(std::memory_order_acquire) << 1) | 1, std::memory_order_relaxed);
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+			}
+		}
+
+		static void leave() {
+			EpochRecord* rec = local();
+			if (--rec->depth == 0) {
+				rec->state.store(0, std::memory_order_release);
+			}
+		}
+
+		static bool tryAdvance() {
+			size_t current = global.load(std::memory_order_acquire);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			for (EpochRecord* rec = records.load(std::memory_order_acquire); rec != nullptr; rec = rec->next) {
+				size_t state = rec->state.load(std::memory_order_acquire);
+				if ((state & 1) && (state >> 1) != current) {
+					return false;
+				}
+			}
+			return global.compare_exchange_strong(current, current + 1, std::memory_order_acq_rel);
+		}
+
+		static void freeBucket(std::vector<RetiredPtr>& bucket) {
+			for (size_t i = 0; i < bucket.size(); ++i)
+			{
+				bucket[i].deleter(bucket[i].ptr);
+			}
+			bucket.clear();
+		}
+
+		static void collect(EpochRecord* rec) {
+			size_t current = global.load(std::memory_order_acquire);
+			for (size_t i = 0; i < 3; ++i)
+			{
+				if (!rec->limbo[i].empty() && rec->limboEpoch[i] + 2 <= current) {
+					freeBucket(rec->limbo[i]);
+				}
+			}
+		}
+
+		static void retire(void* ptr, void (*deleter)(void*)) {
+			EpochRecord* rec = local();
+			size_t current = global.load(std::memory_order_acquire);
+			size_t bucket = current % 3;
+			if (rec->limboEpoch[bucket] != current) {
+				// the bucket last held epoch current - 3 or older, nobody can reach it anymore
+				freeBucket(rec->limbo[bucket]);
+				rec->limboEpoch[bucket] = current;
+			}
+			rec->limbo[bucket].push_back(RetiredPtr{ptr, deleter});
+			if (++rec->retireCount % retireBatch == 0) {
+				tryAdvance();
+				collect(rec);
+			}
+		}
+
+		/*Frees everything this thread has retired, must be called outside of any guard.*/
+		static void flush() {
+			EpochRecord* rec = local();
+			for (size_t i = 0; i < 3; ++i)
+			{
+				tryAdvance();
+			}
+			collect(rec);
+		}
+	};
+
+	struct EpochGuard {
+		EpochGuard() {
+			Epoch::enter();
+		}
+
+		~EpochGuard() {
+			Epoch::leave();
+		}
+	};
+
+	/*Slots above the partitions are read without a lock while partitions are still being added,
+	  so they are loaded and published atomically.*/
+	inline void* loadSlot(void* const* slot) {
+	#if defined(_MSC_VER)
+		return *(void* const volatile*)slot;
+	#else
+		return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	#endif
+	}
+
+	inline void publishSlot(void** slot, void* value) {
+	#if defined(_MSC_VER)
+		*(void* volatile*)slot = value;
+	#else
+		__atomic_store_n(slot, value, __ATOMIC_RELEASE);
+	#endif
+	}
+
+	/*What the slots at the bottom of a tree hold.*/
+	enum LeafKind {
+		VALUE_LEAVES,
+		CHAIN_LEAVES,
+		BUCKET_LEAVES,
+		BLOB_LEAVES
+	};
+
+	/*Sets a tree up for partitions that are made on first touch. Only the root exists, and its
+	  lock word points at the table so the partition functions can grow the tree. Partitions split
+	  down to the last BitNode level, which for bucket trees is one level up.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	void makeParitions(BitNode<keySize, childCount>* tree, Alloc& alloc, PartitionTable<Alloc, Lock>& table, uint32_t splitThreshold, LeafKind kind) {
+		table.alloc = &alloc;
+		table.splitThreshold = splitThreshold;
+		table.splitDepth = kind == BUCKET_LEAVES ? BitNode<keySize, childCount>::bridgesSize - 1 : BitNode<keySize, childCount>::bridgesSize;
+		tree->lock = &table;
+	}
+
+	/*Partition depth a tree can use, at least one level and always above the last node level.*/
+	template <size_t keySize, size_t childCount>
+	constexpr size_t clampPartitionLevels(size_t levels) {
+		return levels < 1 ? 1 : levels > BitNode<keySize, childCount>::bridgesSize - 1 ? BitNode<keySize, childCount>::bridgesSize - 1 : levels;
+	}
+
+	/*The partition node levels below the root on key's path. Missing nodes on the way are made
+	  when create is set, otherwise the key has no partition yet and nullptr comes back.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	BitNode<keySize, childCount>* partitionNode(BitNode<keySize, childCount>* tree, size_t key, size_t levels, bool create) {
+		BitNode<keySize, childCount>* current = tree;
+		for (size_t i = 0; i < levels; ++i)
+		{
+			void** slot = &current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+			BitNode<keySize, childCount>* child = (BitNode<keySize, childCount>*)loadSlot(slot);
+			if (child == nullptr) {
+				if (!create) {
+					return nullptr;
+				}
+				PartitionTable<Alloc, Lock>* table = (PartitionTable<Alloc, Lock>*)tree->lock;
+				std::lock_guard<std::mutex> guard(table->growMux);
+				child = (BitNode<keySize, childCount>*)loadSlot(slot);
+				if (child == nullptr) {
+					child = table->alloc->template make<BitNode<keySize, childCount>>();
+					if (i + 1 == levels) {
+						child->lock = table->next();
+					}
+					publishSlot(slot, child);
+				}
+			}
+			current = child;
+		}
+		return current;
+	}
+
+	/*Gives every child of a hot partition a state of its own. Runs with the partition locked
+	  exclusively, the children are made from its allocator so each one exists before it is
+	  handed out.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	void splitPartition(BitNode<keySize, childCount>* current, PartitionState<Alloc, Lock>* state, PartitionTable<Alloc, Lock>* table) {
+		std::lock_guard<std::mutex> guard(table->growMux);
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			if (current->children[i] == nullptr) {
+				current->children[i] = state->alloc.template make<BitNode<keySize, childCount>>();
+			}
+			((BitNode<keySize, childCount>*)current->children[i])->lock = table->next();
+		}
+		state->split.store(true, std::memory_order_release);
+		// what was cached against this partition now lives in its children
+		state->bumpVersion();
+	}
+
+	/*Whether a partition at depth has seen enough contention to be split.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	bool partitionHot(PartitionState<Alloc, Lock>* state, PartitionTable<Alloc, Lock>* table, size_t depth) {
+		// the children of a partition have to be BitNodes
+		return table->splitThreshold != 0 && depth < table->splitDepth &&
+			state->contention.load(std::memory_order_relaxed) >= table->splitThreshold;
+	}
+
+	/*Locks the partition that owns key, starting at the partition node current at depth. A split
+	  partition passes the walk on to the child partition on the key's path, and a writer splits
+	  its partition first when it has turned hot. current and depth are left on the node of the
+	  partition that was locked.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	PartitionState<Alloc, Lock>* lockPartition(BitNode<keySize, childCount>* tree, BitNode<keySize, childCount>*& current, size_t& depth, size_t key, bool shared) {
+		while (true) {
+			PartitionState<Alloc, Lock>* state = (PartitionState<Alloc, Lock>*)current->lock;
+			if (shared) {
+				state->lockShared();
+			} else {
+				state->lock();
+			}
+			if (!state->split.load(std::memory_order_acquire)) {
+				PartitionTable<Alloc, Lock>* table = (PartitionTable<Alloc, Lock>*)tree->lock;
+				if (shared || !partitionHot<keySize, childCount>(state, table, depth)) {
+					return state;
+				}
+				splitPartition(current, state, table);
+			}
+			if (shared) {
+				state->unlockShared();
+			} else {
+				state->unlock();
+			}
+			// the children of a split partition never change again
+			current = (BitNode<keySize, childCount>*)current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[depth]) & BitNode<keySize, childCount>::bitShift];
+			depth += 1;
+		}
+	}
+
+	/*Chain entries a hashed tree lets pile up in one slot before splitting it, 0 never splits.*/
+	constexpr size_t defaultChainLimit = 8;
+
+	/*A chain slot of a hashed tree can hold, tagged with its low bit, a BitNode that fans the
+	  chain out on the hash bits above keySize, log2(childCount) more bits per split level. Once
+	  the hash runs out of bits the chain just grows. Splitting rehashes the entries it moves
+	  with hashData, so only trees whose keys are hashData of the pair's key may split.*/
+	template <size_t keySize, size_t childCount>
+	struct ChainSplit {
+		typedef BitNode<keySize, childCount> Node;
+		static constexpr size_t hashBits = sizeof(size_t) * CHAR_BIT;
+		static constexpr size_t maxLevels = keySize >= hashBits ? 0 : (hashBits - keySize) / Node::bitCount;
+
+		static bool isSplit(const void* leaf) {
+			return ((uintptr_t)leaf & 1) != 0;
+		}
+
+		static Node* node(void* leaf) {
+			return (Node*)((uintptr_t)leaf - 1);
+		}
+
+		static void* tag(Node* node) {
+			return (void*)((uintptr_t)node + 1);
+		}
+
+		static size_t slot(size_t key, size_t level) {
+			return (key >> (keySize + level * Node::bitCount)) & Node::bitShift;
+		}
+
+		/*The chain head of key below the leaf slot leaf.*/
+		static KeyValueSpot* chain(void* leaf, size_t key) {
+			for (size_t level = 0; isSplit(leaf); ++level)
+			{
+				leaf = node(leaf)->children[slot(key, level)];
+			}
+			return (KeyValueSpot*)leaf;
+		}
+
+		/*Moves the chain in *leaf into a new node one split level down.*/
+		template <class Alloc>
+		static void split(void** leaf, size_t level, Alloc& alloc) {
+			Node* fan = alloc.template make<Node>();
+			KeyValueSpot* gotkv = (KeyValueSpot*)*leaf;
+			while (gotkv != nullptr) {
+				KeyValueSpot* next = gotkv->next;
+				void** to = &fan->children[slot(hashData(gotkv->kvp->key, sizeof(gotkv->kvp->key)), level)];
+				gotkv->next = (KeyValueSpot*)*to;
+				*to = gotkv;
+				gotkv = next;
+			}
+			*leaf = tag(fan);
+		}
+
+		template <class Fn>
+		static void forEach(void* leaf, Fn&& fn) {
+			if (!isSplit(leaf)) {
+				for (KeyValueSpot* gotkv = (KeyValueSpot*)leaf; gotkv != nullptr; gotkv = gotkv->next) {
+					fn(gotkv);
+				}
+				return;
+			}
+			Node* fan = node(leaf);
+			for (size_t i = 0; i < childCount; ++i)
+			{
+				if (fan->children[i] != nullptr) {
+					forEach(fan->children[i], fn);
+				}
+			}
+		}
+
+		template <class Alloc>
+		static void drop(void* leaf, Alloc& alloc) {
+			if (!isSplit(leaf)) {
+				while (leaf != nullptr) {
+					KeyValueSpot* next = ((KeyValueSpot*)leaf)->next;
+					alloc.drop((KeyValueSpot*)leaf);
+					leaf = next;
+				}
+				return;
+			}
+			Node* fan = node(leaf);
+			for (size_t i = 0; i < childCount; ++i)
+			{
+				drop(fan->children[i], alloc);
+			}
+			alloc.drop(fan);
+		}
+	};
+
+	/*Frees every node below tree, which sits at depth. Values are owned by the caller and left alone.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	void freeSubtree(BitNode<keySize, childCount>* tree, size_t depth, LeafKind kind, Alloc& alloc) {
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = tree->children[i];
+			if (child == nullptr) {
+				continue;
+			}
+			if (kind == BUCKET_LEAVES && depth + 1 == BitNode<keySize, childCount>::bridgesSize) {
+				LeafBucket* bucket = (LeafBucket*)child;
+				while (bucket != nullptr) {
+					LeafBucket* next = bucket->overflow;
+					alloc.drop(bucket);
+					bucket = next;
+				}
+			} else if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				freeSubtree((BitNode<keySize, childCount>*)child, depth + 1, kind, alloc);
+				alloc.drop((BitNode<keySize, childCount>*)child);
+			} else if (kind == CHAIN_LEAVES) {
+				ChainSplit<keySize, childCount>::drop(child, alloc);
+			} else if (kind == BLOB_LEAVES) {
+				KeyBlobSpot* spot = (KeyBlobSpot*)child;
+				while (spot != nullptr) {
+					KeyBlobSpot* next = spot->next;
+					KeyBlobSpot::drop(spot, alloc);
+					spot = next;
+				}
+			}
+			tree->children[i] = nullptr;
+		}
+	}
+
+	/*Tears down a partitioned tree, an allocator that owns its memory skips the per node walk.
+	  The states stay with their table.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	void freeParitions(BitNode<keySize, childCount>* tree, size_t level, size_t depth, LeafKind kind, Alloc& alloc, PartitionTable<Alloc, Lock>& table) {
+		if (level == 0) {
+			PartitionState<Alloc, Lock>* state = (PartitionState<Alloc, Lock>*)tree->lock;
+			if (state->split.load(std::memory_order_relaxed)) {
+				for (size_t i = 0; i < childCount; ++i)
+				{
+					BitNode<keySize, childCount>* child = (BitNode<keySize, childCount>*)tree->children[i];
+					freeParitions(child, 0, depth + 1, kind, alloc, table);
+					state->alloc.drop(child);
+					tree->children[i] = nullptr;
+				}
+			} else if (!Alloc::ownsMemory) {
+				freeSubtree(tree, depth, kind, state->alloc);
+			}
+			tree->lock = nullptr;
+			return;
+		}
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			BitNode<keySize, childCount>* child = (BitNode<keySize, childCount>*)tree->children[i];
+			if (child == nullptr) {
+				continue;
+			}
+			freeParitions(child, level - 1, depth + 1, kind, alloc, table);
+			alloc.drop(child);
+			tree->children[i] = nullptr;
+		}
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void insertInto(BitNode<keySize, childCount>* tree, size_t key, void* data, Alloc& alloc) {
+		BitNode<keySize, childCount>* current = tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			//printf("key slice is %zu\n", key >> BitNode<keySize, childCount>::offsets.offsets[i]);
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				current->children[shifted] = alloc.template make<BitNode<keySize, childCount>>();
+			} 
+			current =  (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		current->children[shiftedLast] = data;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertInto(BitNode<keySize, childCount>* tree, size_t key, void* data) {
+		HeapAllocator alloc;
+		insertInto(tree, key, data, alloc);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void insertIntoPart(BitNode<keySize, childCount>* tree, size_t key, void* data, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, true);
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, false);
+		ScopedPartLock scoped(state, std::adopt_lock);
+		Alloc& alloc = state->alloc;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			//printf("key slice is %zu\n", key >> BitNode<keySize, childCount>::offsets.offsets[i]);
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				current->children[shifted] = alloc.template make<BitNode<keySize, childCount>>();
+			} 
+			current =  (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		current->children[shiftedLast] = data;
+	}
+
+	/*Inserts below current, which sits at depth, into a hashed tree. A chain that already holds
+	  chainLimit entries is split first, see ChainSplit.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	void insertHashAt(BitNode<keySize, childCount>* current, size_t depth, size_t key, KeyValuePair* kvp, Alloc& alloc, size_t chainLimit = 0) {
+		typedef ChainSplit<keySize, childCount> Split;
+		size_t i = depth;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			//printf("key slice is %zu\n", key >> BitNode<keySize, childCount>::offsets.offsets[i]);
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			//printf("slice %zu ", shifted);
+			if (current->children[shifted] == nullptr) {
+				current->children[shifted] = alloc.template make<BitNode<keySize, childCount>>();
+			} 
+			current =  (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		//printf("slice %zu\n", shiftedLast);
+		void** slot = &current->children[shiftedLast];
+		size_t level = 0;
+		while (true) {
+			for (; Split::isSplit(*slot); ++level)
+			{
+				slot = &Split::node(*slot)->children[Split::slot(key, level)];
+			}
+			size_t length = 0;
+			for (KeyValueSpot* gotkv = (KeyValueSpot*)*slot; gotkv != nullptr; gotkv = gotkv->next) {
+				if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
+					gotkv->kvp->value = kvp->value;
+					return;
+				}
+				length += 1;
+			}
+			if (chainLimit == 0 || length < chainLimit || level >= Split::maxLevels) {
+				break;
+			}
+			Split::split(slot, level, alloc);
+		}
+		KeyValueSpot* newkvs = alloc.template make<KeyValueSpot>();
+		newkvs->kvp = kvp;
+		newkvs->next = (KeyValueSpot*)*slot;
+		*slot = newkvs;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void insertHash(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, Alloc& alloc) {
+		insertHashAt(tree, 0, key, kvp, alloc);
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertHash(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
+		HeapAllocator alloc;
+		insertHash(tree, key, kvp, alloc);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void insertHashPart(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels, size_t chainLimit = 0) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, true);
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, false);
+		ScopedPartLock scoped(state, std::adopt_lock);
+		insertHashAt(current, i, key, kvp, state->alloc, chainLimit);
+	}
+
+	/*Flat combining version of insertHashPart for partitions that many writers hit at once. The
+	  write is posted to the partition's publication array, and whichever thread gets the lock
+	  applies every posted write in one pass while the others wait on their slot, so the hot
+	  subtree stays in one core's cache. Writes to a partition that splits meanwhile are taken
+	  back and retried below it.*/
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void insertHashCombined(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels, size_t chainLimit = 0) {
+		typedef PartitionState<Alloc, Lock> State;
+		PartitionTable<Alloc, Lock>* table = (PartitionTable<Alloc, Lock>*)tree->lock;
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, true);
+		size_t depth = levels;
+		while (true) {
+			State* state = (State*)current->lock;
+			if (state->split.load(std::memory_order_acquire)) {
+				// the children of a split partition never change again
+				current = (BitNode<keySize, childCount>*)current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[depth]) & BitNode<keySize, childCount>::bitShift];
+				depth += 1;
+				continue;
+			}
+			CombineSlot* slots = state->combineSlotArray();
+			CombineSlot* mine = nullptr;
+			for (size_t i = statShard(); mine == nullptr; ++i)
+			{
+				CombineSlot* slot = &slots[i % State::combineSlots];
+				void* expected = nullptr;
+				// the slot's own address reserves it until key is written
+				if (slot->request.load(std::memory_order_relaxed) == nullptr &&
+					slot->request.compare_exchange_strong(expected, slot, std::memory_order_acquire, std::memory_order_relaxed)) {
+					slot->key = key;
+					slot->request.store(kvp, std::memory_order_release);
+					mine = slot;
+				}
+				if (i % State::combineSlots == State::combineSlots - 1) {
+					cpuRelax();
+				}
+			}
+			unsigned backoff = 1;
+			bool retry = false;
+			while (mine->request.load(std::memory_order_acquire) == kvp) {
+				if (state->split.load(std::memory_order_acquire)) {
+					// only this thread clears its slot unless a holder applied it before the split
+					void* expected = kvp;
+					retry = mine->request.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel);
+					break;
+				}
+				if (!state->tryLock()) {
+					if (backoff < 1024) {
+						for (unsigned i = 0; i < backoff; ++i)
+						{
+							cpuRelax();
+						}
+						backoff *= 2;
+					} else {
+						std::this_thread::yield();
+					}
+					continue;
+				}
+				ScopedPartLock scoped(state, std::adopt_lock);
+				if (state->split.load(std::memory_order_relaxed)) {
+					continue;
+				}
+				if (partitionHot<keySize, childCount>(state, table, depth)) {
+					splitPartition(current, state, table);
+					continue;
+				}
+				// a few passes pick up writes posted while the first one ran
+				for (size_t pass = 0; pass < 3; ++pass)
+				{
+					bool applied = false;
+					for (size_t i = 0; i < State::combineSlots; ++i)
+					{
+						void* posted = slots[i].request.load(std::memory_order_acquire);
+						if (posted != nullptr && posted != &slots[i]) {
+							insertHashAt(current, depth, slots[i].key, (KeyValuePair*)posted, state->alloc, chainLimit);
+							// the poster may look its key up before this holder unlocks
+							state->bumpVersion();
+							slots[i].request.store(nullptr, std::memory_order_release);
+							applied = true;
+						}
+					}
+					if (!applied) {
+						break;
+					}
+				}
+			}
+			if (!retry) {
+				return;
+			}
+		}
+	}
+
+	/*Looks key up below current, which sits at depth.*/
+	template <size_t keySize, size_t childCount>
+	void* findIntoAt(BitNode<keySize, childCount>* current, size_t depth, size_t key) {
+		size_t i = depth;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				return nullptr;
+			}
+			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		return current->children[shiftedLast];
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findInto(BitNode<keySize, childCount>* tree, size_t key) {
+		return findIntoAt(tree, 0, key);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void* findIntoPart(BitNode<keySize, childCount>* tree, size_t key, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, false);
+		if (current == nullptr) {
+			return nullptr;
+		}
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, true);
+		ScopedPartReadLock scoped(state, std::adopt_lock);
+		void* found = findIntoAt(current, i, key);
+		state->counters.recordFind(found);
+		return found;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findHashAt(BitNode<keySize, childCount>* current, size_t depth, size_t key, KeyValuePair* kvp) {
+		size_t i = depth;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				return nullptr;
+			}
+			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		KeyValueSpot* gotkv = ChainSplit<keySize, childCount>::chain(current->children[shiftedLast], key);
+		while (gotkv != nullptr) {
+			if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
+				return gotkv->kvp->value;
+			}
+			gotkv = gotkv->next;
+		}
+		return nullptr;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findHash(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
+		return findHashAt(tree, 0, key, kvp);
+	}
+
+	/*One remembered lookup of a front cache, owner tells the maps sharing the cache apart and
+	  version is the partition's version when value was read.*/
+	struct alignas(64) FrontCacheEntry {
+		unsigned char key[16];
+		void* value;
+		const std::atomic<uint64_t>* versionOf;
+		uint64_t version;
+		uint64_t owner;
+	};
+
+	/*Small direct mapped cache of recent hashed lookups, one per thread and shared by every map
+	  that uses one. An entry is only trusted while its partition's version has not moved.*/
+	struct FrontCache {
+		static constexpr size_t entryCount = 256;
+
+		static FrontCacheEntry* entries() {
+			static thread_local FrontCacheEntry cache[entryCount] = {};
+			return cache;
+		}
+
+		/*Owners are never reused, so an entry of a map that is gone can not be mistaken for one of
+		  a later map at the same address.*/
+		static uint64_t newOwner() {
+			static std::atomic<uint64_t> next(1);
+			return next.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		/*Cheaper than hashData, it only has to spread hot keys over the entries.*/
+		static FrontCacheEntry& entry(uint64_t owner, const unsigned char* key) {
+			uint64_t a;
+			uint64_t b;
+			std::memcpy(&a, key, sizeof(a));
+			std::memcpy(&b, key + sizeof(a), sizeof(b));
+			uint64_t mixed = (a ^ owner) * 0x9E3779B97F4A7C15ull ^ b * 0xC2B2AE3D27D4EB4Full;
+			return entries()[(mixed >> 32) % entryCount];
+		}
+	};
+
+	/*findHashPart behind the calling thread's FrontCache. A hit takes no lock and never touches
+	  the tree, only the partition's version, and misses are cached too.*/
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void* findHashCached(BitNode<keySize, childCount>* tree, KeyValuePair* kvp, size_t levels, uint64_t owner) {
+		static_assert(sizeof(FrontCacheEntry::key) == sizeof(kvp->key));
+		FrontCacheEntry& entry = FrontCache::entry(owner, kvp->key);
+		if (entry.owner == owner && std::memcmp(entry.key, kvp->key, sizeof(entry.key)) == 0 &&
+			entry.versionOf->load(std::memory_order_acquire) == entry.version) {
+			return entry.value;
+		}
+		size_t key = hashData(kvp->key, sizeof(kvp->key));
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, false);
+		if (current == nullptr) {
+			return nullptr;
+		}
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, true);
+		ScopedPartReadLock scoped(state, std::adopt_lock);
+		void* found = findHashAt(current, i, key, kvp);
+		state->counters.recordFind(found);
+		std::memcpy(entry.key, kvp->key, sizeof(entry.key));
+		entry.value = found;
+		entry.versionOf = &state->version;
+		entry.version = state->version.load(std::memory_order_relaxed);
+		entry.owner = owner;
+		return found;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void* findHashPart(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, false);
+		if (current == nullptr) {
+			return nullptr;
+		}
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, true);
+		ScopedPartReadLock scoped(state, std::adopt_lock);
+		void* found = findHashAt(current, i, key, kvp);
+		state->counters.recordFind(found);
+		return found;
+	}
+
+	/*Bucket trees stop one level early, the last BitNode's slots hold LeafBuckets.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	void insertBucket(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, Alloc& alloc) {
+		BitNode<keySize, childCount>* current = tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize - 1; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				current->children[shifted] = alloc.template make<BitNode<keySize, childCount>>();
+			}
+			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		putBucket(&current->children[shiftedLast], key, kvp, alloc);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void insertBucketPart(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, true);
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, false);
+		ScopedPartLock scoped(state, std::adopt_lock);
+		Alloc& alloc = state->alloc;
+		for (; i < BitNode<keySize, childCount>::bridgesSize - 1; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				current->children[shifted] = alloc.template make<BitNode<keySize, childCount>>();
+			}
+			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		putBucket(&current->children[shiftedLast], key, kvp, alloc);
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findBucketAt(BitNode<keySize, childCount>* current, size_t depth, size_t key, KeyValuePair* kvp) {
+		size_t i = depth;
+		for (; i < BitNode<keySize, childCount>::bridgesSize - 1; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				return nullptr;
+			}
+			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		return getBucket(current->children[shiftedLast], key, kvp);
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findBucket(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
+		return findBucketAt(tree, 0, key, kvp);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void* findBucketPart(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, false);
+		if (current == nullptr) {
+			return nullptr;
+		}
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, true);
+		ScopedPartReadLock scoped(state, std::adopt_lock);
+		void* found = findBucketAt(current, i, key, kvp);
+		state->counters.recordFind(found);
+		return found;
+	}
+
+	/*Returns the slot for index in the compact node *ref, adding an empty one if it is missing.
+	  A full node is regrown and *ref repointed at the new copy.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	void** claimCompact(void** ref, size_t index, Alloc& alloc) {
+		CompactBitNode<keySize, childCount>* node = (CompactBitNode<keySize, childCount>*)*ref;
+		uint64_t bit = 1ULL << index;
+		size_t pos = popCount(node->bitmap & (bit - 1));
+		if (node->bitmap & bit) {
+			return &node->slots()[pos];
+		}
+		size_t count = popCount(node->bitmap);
+		if (count == node->capacity) {
+			size_t capacity = node->capacity * 2 < childCount ? node->capacity * 2 : childCount;
+			CompactBitNode<keySize, childCount>* grown = CompactBitNode<keySize, childCount>::make(capacity, alloc);
+			grown->bitmap = node->bitmap;
+			std::memcpy(grown->slots(), node->slots(), count * sizeof(void*));
+			CompactBitNode<keySize, childCount>::drop(node, alloc);
+			node = grown;
+			*ref = node;
+		}
+		void** slots = node->slots();
+		std::memmove(&slots[pos + 1], &slots[pos], (count - pos) * sizeof(void*));
+		slots[pos] = nullptr;
+		node->bitmap |= bit;
+		return &slots[pos];
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void** descendCompact(CompactBitNode<keySize, childCount>** tree, size_t key, Alloc& alloc) {
+		void** ref = (void**)tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			void** slot = claimCompact<keySize, childCount>(ref, shifted, alloc);
+			if (*slot == nullptr) {
+				*slot = CompactBitNode<keySize, childCount>::make(1, alloc);
+			}
+			ref = slot;
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		return claimCompact<keySize, childCount>(ref, shiftedLast, alloc);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void insertInto(CompactBitNode<keySize, childCount>** tree, size_t key, void* data, Alloc& alloc) {
+		*descendCompact(tree, key, alloc) = data;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void insertHash(CompactBitNode<keySize, childCount>** tree, size_t key, KeyValuePair* kvp, Alloc& alloc) {
+		void** slot = descendCompact(tree, key, alloc);
+		KeyValueSpot* gotkv = (KeyValueSpot*)*slot;
+		while (gotkv != nullptr) {
+			if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
+				gotkv->kvp->value = kvp->value;
+				return;
+			}
+			gotkv = gotkv->next;
+		}
+		KeyValueSpot* newkvs = alloc.template make<KeyValueSpot>();
+		newkvs->kvp = kvp;
+		newkvs->next = (KeyValueSpot*)*slot;
+		*slot = newkvs;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findInto(CompactBitNode<keySize, childCount>* tree, size_t key) {
+		CompactBitNode<keySize, childCount>* current = tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			current = (CompactBitNode<keySize, childCount>*)current->get(shifted);
+			if (current == nullptr) {
+				return nullptr;
+			}
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		return current->get(shiftedLast);
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findHash(CompactBitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
+		CompactBitNode<keySize, childCount>* current = tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			current = (CompactBitNode<keySize, childCount>*)current->get(shifted);
+			if (current == nullptr) {
+				return nullptr;
+			}
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		KeyValueSpot* gotkv = (KeyValueSpot*)current->get(shiftedLast);
+		while (gotkv != nullptr) {
+			if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
+				return gotkv->kvp->value;
+			}
+			gotkv = gotkv->next;
+		}
+		return nullptr;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void freeCompactSubtree(CompactBitNode<keySize, childCount>* tree, size_t depth, LeafKind kind, Alloc& alloc) {
+		void** slots = tree->slots();
+		size_t count = popCount(tree->bitmap);
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (slots[i] == nullptr) {
+				continue;
+			}
+			if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				CompactBitNode<keySize, childCount>* child = (CompactBitNode<keySize, childCount>*)slots[i];
+				freeCompactSubtree(child, depth + 1, kind, alloc);
+				CompactBitNode<keySize, childCount>::drop(child, alloc);
+			} else if (kind == CHAIN_LEAVES) {
+				KeyValueSpot* gotkv = (KeyValueSpot*)slots[i];
+				while (gotkv != nullptr) {
+					KeyValueSpot* next = gotkv->next;
+					alloc.drop(gotkv);
+					gotkv = next;
+				}
+			}
+		}
+		tree->bitmap = 0;
+	}
+
+	template <size_t keySize, size_t childCount>
+	uint32_t descendSlim(SlimStore<keySize, childCount>& store, size_t key, size_t levels) {
+		uint32_t current = 0;
+		for (size_t i = 0; i < levels; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			uint32_t child = store.nodes[current].children[shifted];
+			if (child == 0) {
+				// makeNode may move the node array, so the parent is looked up again afterwards
+				child = store.makeNode();
+				store.nodes[current].children[shifted] = child;
+			}
+			current = child;
+		}
+		return current;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertInto(SlimStore<keySize, childCount>& store, size_t key, void* data) {
+		static constexpr size_t last = BitNode<keySize, childCount>::bridgesSize;
+		uint32_t node = descendSlim(store, key, last - 1);
+		size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[last - 1]) & BitNode<keySize, childCount>::bitShift;
+		uint32_t ref = store.nodes[node].children[shifted];
+		if (ref == 0) {
+			ref = store.makeValues();
+			store.nodes[node].children[shifted] = ref;
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[last]) & BitNode<keySize, childCount>::bitShift;
+		store.values[ref & ~slimLeafTag].values[shiftedLast] = data;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertHash(SlimStore<keySize, childCount>& store, size_t key, KeyValuePair* kvp) {
+		uint32_t node = descendSlim(store, key, BitNode<keySize, childCount>::bridgesSize);
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[BitNode<keySize, childCount>::bridgesSize]) & BitNode<keySize, childCount>::bitShift;
+		uint32_t head = store.nodes[node].children[shiftedLast];
+		for (uint32_t ref = head; ref != 0; ref = store.leaf(ref).next) {
+			KeyValuePair* gotkv = (KeyValuePair*)store.leaf(ref).value;
+			if (std::memcmp(gotkv->key, kvp->key, sizeof(kvp->key)) == 0) {
+				gotkv->value = kvp->value;
+				return;
+			}
+		}
+		uint32_t ref = store.makeLeaf(kvp, head);
+		store.nodes[node].children[shiftedLast] = ref;
+	}
+
+	/*The tagged reference found after walking levels nodes, 0 when the path ends early.*/
+	template <size_t keySize, size_t childCount>
+	uint32_t findSlimRef(const SlimStore<keySize, childCount>& store, size_t key, size_t levels) {
+		const SlimBitNode<keySize, childCount>* nodes = store.nodes.data();
+		uint32_t current = 0;
+		size_t i = 0;
+		for (; i < levels; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			current = nodes[current].children[shifted];
+			if (current == 0) {
+				return 0;
+			}
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		return nodes[current].children[shiftedLast];
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findInto(const SlimStore<keySize, childCount>& store, size_t key) {
+		static constexpr size_t last = BitNode<keySize, childCount>::bridgesSize;
+		uint32_t ref = findSlimRef(store, key, last - 1);
+		if (ref == 0) {
+			return nullptr;
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[last]) & BitNode<keySize, childCount>::bitShift;
+		return store.values[ref & ~slimLeafTag].values[shiftedLast];
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findHash(const SlimStore<keySize, childCount>& store, size_t key, KeyValuePair* kvp) {
+		uint32_t ref = findSlimRef(store, key, BitNode<keySize, childCount>::bridgesSize);
+		while ((ref & slimLeafTag) != 0) {
+			const SlimLeaf& leaf = store.leaves[ref & ~slimLeafTag];
+			KeyValuePair* gotkv = (KeyValuePair*)leaf.value;
+			if (std::memcmp(gotkv->key, kvp->key, sizeof(kvp->key)) == 0) {
+				return gotkv->value;
+			}
+			ref = leaf.next;
+		}
+		return nullptr;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void insertBlobPart(BitNode<keySize, childCount>* tree, size_t key, const void* keyData, size_t keyLen, void* value, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, true);
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, false);
+		ScopedPartLock scoped(state, std::adopt_lock);
+		Alloc& alloc = state->alloc;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				current->children[shifted] = alloc.template make<BitNode<keySize, childCount>>();
+			}
+			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		KeyBlobSpot* spot = (KeyBlobSpot*)current->children[shiftedLast];
+		for (; spot != nullptr; spot = spot->next) {
+			if (spot->matches(key, keyData, keyLen)) {
+				spot->value = value;
+				return;
+			}
+		}
+		KeyBlobSpot* newspot = KeyBlobSpot::make(key, keyData, keyLen, alloc);
+		newspot->value = value;
+		newspot->next = (KeyBlobSpot*)current->children[shiftedLast];
+		current->children[shiftedLast] = newspot;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findBlobAt(BitNode<keySize, childCount>* current, size_t depth, size_t key, const void* keyData, size_t keyLen) {
+		size_t i = depth;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			if (current->children[shifted] == nullptr) {
+				return nullptr;
+			}
+			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		for (KeyBlobSpot* spot = (KeyBlobSpot*)current->children[shiftedLast]; spot != nullptr; spot = spot->next) {
+			if (spot->matches(key, keyData, keyLen)) {
+				return spot->value;
+			}
+		}
+		return nullptr;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void* findBlobPart(BitNode<keySize, childCount>* tree, size_t key, const void* keyData, size_t keyLen, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, false);
+		if (current == nullptr) {
+			return nullptr;
+		}
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, true);
+		ScopedPartReadLock scoped(state, std::adopt_lock);
+		void* found = findBlobAt(current, i, key, keyData, keyLen);
+		state->counters.recordFind(found);
+		return found;
+	}
+
+	/*Batched lookups. Keys are processed in groups that all advance one level per round, and the
+	  slot each key reads next is prefetched before any of them is read, so the cache misses of a
+	  group overlap instead of being paid one after another.*/
+	static constexpr size_t batchGroup = 16;
+
+	template <size_t keySize, size_t childCount>
+	void walkBatch(BitNode<keySize, childCount>** cursors, const size_t* keys, size_t n, size_t from, size_t to) {
+		typedef BitNode<keySize, childCount> Node;
+		for (size_t i = from; i < to; ++i)
+		{
+			for (size_t j = 0; j < n; ++j)
+			{
+				if (cursors[j] == nullptr) {
+					continue;
+				}
+				cursors[j] = (Node*)cursors[j]->children[(keys[j] >> Node::offsets.offsets[i]) & Node::bitShift];
+				if (cursors[j] != nullptr) {
+					prefetchRead(&cursors[j]->children[(keys[j] >> Node::offsets.offsets[i + 1]) & Node::bitShift]);
+				}
+			}
+		}
+	}
+
+	/*Same as walkBatch, but cursor j only starts moving at depths[j].*/
+	template <size_t keySize, size_t childCount>
+	void walkBatch(BitNode<keySize, childCount>** cursors, const size_t* depths, const size_t* keys, size_t n, size_t from, size_t to) {
+		typedef BitNode<keySize, childCount> Node;
+		for (size_t i = from; i < to; ++i)
+		{
+			for (size_t j = 0; j < n; ++j)
+			{
+				if (cursors[j] == nullptr || i < depths[j]) {
+					continue;
+				}
+				cursors[j] = (Node*)cursors[j]->children[(keys[j] >> Node::offsets.offsets[i]) & Node::bitShift];
+				if (cursors[j] != nullptr) {
+					prefetchRead(&cursors[j]->children[(keys[j] >> Node::offsets.offsets[i + 1]) & Node::bitShift]);
+				}
+			}
+		}
+	}
+
+	/*Finds and read locks the partitions of a batch. cursors start on the partition nodes, null
+	  for keys without a partition, and follow splits down to the partitions that hold the keys.
+	  A split that lands before the locks are all held makes the batch try again.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	void lockBatchPartitions(BitNode<keySize, childCount>** cursors, size_t* depths, const size_t* keys, PartitionState<Alloc, Lock>** states, size_t n, ScopedPartGroupLock<Alloc, Lock>& scoped) {
+		typedef BitNode<keySize, childCount> Node;
+		while (true) {
+			for (size_t j = 0; j < n; ++j)
+			{
+				states[j] = nullptr;
+				if (cursors[j] == nullptr) {
+					continue;
+				}
+				states[j] = (PartitionState<Alloc, Lock>*)cursors[j]->lock;
+				while (states[j]->split.load(std::memory_order_acquire)) {
+					cursors[j] = (Node*)cursors[j]->children[(keys[j] >> Node::offsets.offsets[depths[j]]) & Node::bitShift];
+					depths[j] += 1;
+					states[j] = (PartitionState<Alloc, Lock>*)cursors[j]->lock;
+				}
+			}
+			scoped.acquire(states, n);
+			bool stable = true;
+			for (size_t j = 0; j < n; ++j)
+			{
+				if (states[j] != nullptr && states[j]->split.load(std::memory_order_relaxed)) {
+					stable = false;
+				}
+			}
+			if (stable) {
+				return;
+			}
+			scoped.release();
+		}
+	}
+
+	inline void finishHashBatch(KeyValueSpot** spots, KeyValuePair* const* kvps, void** out, size_t n) {
+		for (size_t j = 0; j < n; ++j)
+		{
+			if (spots[j] != nullptr) {
+				prefetchRead(spots[j]->kvp);
+			}
+		}
+		for (size_t j = 0; j < n; ++j)
+		{
+			out[j] = nullptr;
+			for (KeyValueSpot* gotkv = spots[j]; gotkv != nullptr; gotkv = gotkv->next) {
+				if (std::memcmp(gotkv->kvp->key, kvps[j]->key, sizeof(kvps[j]->key)) == 0) {
+					out[j] = gotkv->kvp->value;
+					break;
+				}
+			}
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void findBatch(BitNode<keySize, childCount>* tree, const size_t* keys, void** out, size_t count) {
+		typedef BitNode<keySize, childCount> Node;
+		Node* cursors[batchGroup];
+		for (size_t base = 0; base < count; base += batchGroup) {
+			size_t n = count - base < batchGroup ? count - base : batchGroup;
+			for (size_t j = 0; j < n; ++j)
+			{
+				cursors[j] = tree;
+			}
+			walkBatch<keySize, childCount>(cursors, keys + base, n, 0, Node::bridgesSize);
+			for (size_t j = 0; j < n; ++j)
+			{
+				out[base + j] = cursors[j] == nullptr ? nullptr : cursors[j]->children[(keys[base + j] >> Node::offsets.offsets[Node::bridgesSize]) & Node::bitShift];
+			}
+		}
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void findBatchPart(BitNode<keySize, childCount>* tree, const size_t* keys, void** out, size_t count, size_t levels) {
+		typedef BitNode<keySize, childCount> Node;
+		Node* cursors[batchGroup];
+		size_t depths[batchGroup];
+		PartitionState<Alloc, Lock>* states[batchGroup];
+		for (size_t base = 0; base < count; base += batchGroup) {
+			size_t n = count - base < batchGroup ? count - base : batchGroup;
+			for (size_t j = 0; j < n; ++j)
+			{
+				cursors[j] = partitionNode<keySize, childCount, Alloc, Lock>(tree, keys[base + j], levels, false);
+				depths[j] = levels;
+			}
+			ScopedPartGroupLock<Alloc, Lock> scoped;
+			lockBatchPartitions<keySize, childCount, Alloc, Lock>(cursors, depths, keys + base, states, n, scoped);
+			walkBatch<keySize, childCount>(cursors, depths, keys + base, n, levels, Node::bridgesSize);
+			for (size_t j = 0; j < n; ++j)
+			{
+				out[base + j] = cursors[j] == nullptr ? nullptr : cursors[j]->children[(keys[base + j] >> Node::offsets.offsets[Node::bridgesSize]) & Node::bitShift];
+				if (states[j] != nullptr) {
+					states[j]->counters.recordFind(out[base + j]);
+				}
+			}
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void findHashBatch(BitNode<keySize, childCount>* tree, const size_t* keys, KeyValuePair* const* kvps, void** out, size_t count) {
+		typedef BitNode<keySize, childCount> Node;
+		Node* cursors[batchGroup];
+		KeyValueSpot* spots[batchGroup];
+		for (size_t base = 0; base < count; base += batchGroup) {
+			size_t n = count - base < batchGroup ? count - base : batchGroup;
+			for (size_t j = 0; j < n; ++j)
+			{
+				cursors[j] = tree;
+			}
+			walkBatch<keySize, childCount>(cursors, keys + base, n, 0, Node::bridgesSize);
+			for (size_t j = 0; j < n; ++j)
+			{
+				spots[j] = cursors[j] == nullptr ? nullptr : ChainSplit<keySize, childCount>::chain(cursors[j]->children[(keys[base + j] >> Node::offsets.offsets[Node::bridgesSize]) & Node::bitShift], keys[base + j]);
+				if (spots[j] != nullptr) {
+					prefetchRead(spots[j]);
+				}
+			}
+			finishHashBatch(spots, kvps + base, out + base, n);
+		}
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void findHashBatchPart(BitNode<keySize, childCount>* tree, const size_t* keys, KeyValuePair* const* kvps, void** out, size_t count, size_t levels) {
+		typedef BitNode<keySize, childCount> Node;
+		Node* cursors[batchGroup];
+		size_t depths[batchGroup];
+		KeyValueSpot* spots[batchGroup];
+		PartitionState<Alloc, Lock>* states[batchGroup];
+		for (size_t base = 0; base < count; base += batchGroup) {
+			size_t n = count - base < batchGroup ? count - base : batchGroup;
+			for (size_t j = 0; j < n; ++j)
+			{
+				cursors[j] = partitionNode<keySize, childCount, Alloc, Lock>(tree, keys[base + j], levels, false);
+				depths[j] = levels;
+			}
+			ScopedPartGroupLock<Alloc, Lock> scoped;
+			lockBatchPartitions<keySize, childCount, Alloc, Lock>(cursors, depths, keys + base, states, n, scoped);
+			walkBatch<keySize, childCount>(cursors, depths, keys + base, n, levels, Node::bridgesSize);
+			for (size_t j = 0; j < n; ++j)
+			{
+				spots[j] = cursors[j] == nullptr ? nullptr : ChainSplit<keySize, childCount>::chain(cursors[j]->children[(keys[base + j] >> Node::offsets.offsets[Node::bridgesSize]) & Node::bitShift], keys[base + j]);
+				if (spots[j] != nullptr) {
+					prefetchRead(spots[j]);
+				}
+			}
+			finishHashBatch(spots, kvps + base, out + base, n);
+			for (size_t j = 0; j < n; ++j)
+			{
+				if (states[j] != nullptr) {
+					states[j]->counters.recordFind(out[base + j]);
+				}
+			}
+		}
+	}
+
+	/*Spreads a bulk load over threads. Keys are grouped by their top level child with a stable
+	  counting sort, each thread gets a contiguous run of top level children holding roughly the
+	  same number of keys and calls build(thread, first, last) over the key indices of that run.
+	  Subtrees of different top level children share no nodes, so the builders need no locking,
+	  and a key repeated in the input still ends with the value that came last.*/
+	template <size_t keySize, size_t childCount, class Build>
+	void bulkBuild(const size_t* keys, size_t count, size_t threads, Build build) {
+		typedef BitNode<keySize, childCount> Node;
+		std::vector<size_t> starts(childCount + 1, 0);
+		for (size_t i = 0; i < count; ++i)
+		{
+			starts[((keys[i] >> Node::offsets.offsets[0]) & Node::bitShift) + 1] += 1;
+		}
+		for (size_t c = 0; c < childCount; ++c)
+		{
+			starts[c + 1] += starts[c];
+		}
+		std::vector<size_t> order(count);
+		std::vector<size_t> fill(starts.begin(), starts.end() - 1);
+		for (size_t i = 0; i < count; ++i)
+		{
+			order[fill[(keys[i] >> Node::offsets.offsets[0]) & Node::bitShift]++] = i;
+		}
+		if (threads > childCount) {
+			threads = childCount;
+		}
+		if (threads <= 1) {
+			build(0, order.data(), order.data() + count);
+			return;
+		}
+		std::vector<std::thread> pool;
+		size_t child = 0;
+		for (size_t t = 0; t < threads; ++t)
+		{
+			size_t first = starts[child];
+			size_t target = count * (t + 1) / threads;
+			while (child < childCount && (starts[child + 1] <= target || t + 1 == threads)) {
+				child += 1;
+			}
+			size_t last = starts[child];
+			if (last > first) {
+				pool.emplace_back(build, t, order.data() + first, order.data() + last);
+			}
+		}
+		for (size_t t = 0; t < pool.size(); ++t)
+		{
+			pool[t].join();
+		}
+	}
+
+	/*Subtree waiting in a parallel walk, key holds the slices taken above node.*/
+	template <size_t keySize, size_t childCount>
+	struct WalkTask {
+		BitNode<keySize, childCount>* node;
+		size_t depth;
+		size_t key;
+	};
+
+	/*Work-stealing scheduler of parallelWalk. Every worker pushes and pops subtrees at the back of
+	  its own deque and steals from the front of the others, where the larger subtrees sit. A worker
+	  that finds nothing to run shows up in idle, and busy workers then hand out the children of
+	  the node they are on instead of walking them, so an unbalanced tree is split deeper.*/
+	template <size_t keySize, size_t childCount, class Visit>
+	struct WalkPool {
+		typedef BitNode<keySize, childCount> Node;
+		typedef WalkTask<keySize, childCount> Task;
+
+		struct alignas(64) Queue {
+			std::mutex mux;
+			std::deque<Task> tasks;
+		};
+
+		std::unique_ptr<Queue[]> queues;
+		size_t workers;
+		std::atomic<size_t> pending{0};
+		std::atomic<size_t> idle{0};
+		Visit& visit;
+
+		WalkPool(size_t workers, Visit& visit) : queues(new Queue[workers]), workers(workers), visit(visit) {}
+
+		void push(size_t worker, const Task& task) {
+			pending.fetch_add(1, std::memory_order_relaxed);
+			std::lock_guard<std::mutex> guard(queues[worker].mux);
+			queues[worker].tasks.push_back(task);
+		}
+
+		bool take(size_t worker, Task& task) {
+			{
+				std::lock_guard<std::mutex> guard(queues[worker].mux);
+				if (!queues[worker].tasks.empty()) {
+					task = queues[worker].tasks.back();
+					queues[worker].tasks.pop_back();
+					return true;
+				}
+			}
+			for (size_t i = 1; i < workers; ++i)
+			{
+				Queue& victim = queues[(worker + i) % workers];
+				std::lock_guard<std::mutex> guard(victim.mux);
+				if (!victim.tasks.empty()) {
+					task = victim.tasks.front();
+					victim.tasks.pop_front();
+					return true;
+				}
+			}
+			return false;
+		}
+
+		void walk(size_t worker, Node* node, size_t depth, size_t key) {
+			for (size_t i = 0; i < childCount; ++i)
+			{
+				void* child = node->children[i];
+				if (child == nullptr) {
+					continue;
+				}
+				size_t childKey = key | (i << Node::offsets.offsets[depth]);
+				if (depth == Node::bridgesSize) {
+					visit(worker, childKey, child);
+				} else if (depth + 1 < Node::bridgesSize && idle.load(std::memory_order_relaxed) != 0) {
+					push(worker, Task{(Node*)child, depth + 1, childKey});
+				} else {
+					walk(worker, (Node*)child, depth + 1, childKey);
+				}
+			}
+		}
+
+		void run(size_t worker) {
+			Task task;
+			while (pending.load(std::memory_order_acquire) != 0) {
+				if (take(worker, task)) {
+					walk(worker, task.node, task.depth, task.key);
+					pending.fetch_sub(1, std::memory_order_acq_rel);
+					continue;
+				}
+				idle.fetch_add(1, std::memory_order_relaxed);
+				std::this_thread::yield();
+				idle.fetch_sub(1, std::memory_order_relaxed);
+			}
+		}
+	};
+
+	/*Calls visit(worker, key, leaf) for every used leaf slot below tree from up to threads threads,
+	  worker being below threads so callers can keep per thread state. The top level children are
+	  dealt out first and the rest is balanced by stealing. Writers must stay out of the tree for
+	  the duration of the walk.*/
+	template <size_t keySize, size_t childCount, class Visit>
+	void parallelWalk(BitNode<keySize, childCount>* tree, size_t threads, Visit visit) {
+		if (threads == 0) {
+			threads = 1;
+		}
+		WalkPool<keySize, childCount, Visit> pool(threads, visit);
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = tree->children[i];
+			if (child == nullptr) {
+				continue;
+			}
+			size_t key = i << BitNode<keySize, childCount>::offsets.offsets[0];
+			if (BitNode<keySize, childCount>::bridgesSize == 0) {
+				visit(0, key, child);
+			} else {
+				pool.push(i % threads, WalkTask<keySize, childCount>{(BitNode<keySize, childCount>*)child, 1, key});
+			}
+		}
+		std::vector<std::thread> helpers;
+		for (size_t t = 1; t < threads; ++t)
+		{
+			helpers.emplace_back([&pool, t] { pool.run(t); });
+		}
+		pool.run(0);
+		for (size_t t = 0; t < helpers.size(); ++t)
+		{
+			helpers[t].join();
+		}
+	}
+
+	/*Per worker accumulator of a parallel reduce, one per cache line.*/
+	template <class T>
+	struct alignas(64) ReduceSlot {
+		T value;
+	};
+
+	/*Folds map(entry) over every entry of tree with combine. init must be an identity of combine,
+	  each worker starts from it and the partial results are combined at the end. forLeaf(leaf, fn)
+	  hands each entry stored in a leaf slot to fn.*/
+	template <size_t keySize, size_t childCount, class T, class ForLeaf, class Map, class Combine>
+	T parallelReduce(BitNode<keySize, childCount>* tree, size_t threads, T init, ForLeaf forLeaf, Map map, Combine combine) {
+		if (threads == 0) {
+			threads = 1;
+		}
+		std::vector<ReduceSlot<T>> partial(threads, ReduceSlot<T>{init});
+		parallelWalk(tree, threads, [&](size_t worker, size_t key, void* leaf) {
+			forLeaf(key, leaf, [&](auto&&... entry) {
+				partial[worker].value = combine(partial[worker].value, map(entry...));
+			});
+		});
+		T result = partial[0].value;
+		for (size_t t = 1; t < threads; ++t)
+		{
+			result = combine(result, partial[t].value);
+		}
+		return result;
+	}
+
+	/*Leaf readers for parallelReduce. An integer tree yields (key, value), a hashed tree yields
+	  each KeyValuePair chained in the slot.*/
+	struct ValueLeafEntries {
+		template <class Fn>
+		void operator()(size_t key, void* leaf, Fn&& fn) const {
+			fn(key, leaf);
+		}
+	};
+
+	template <size_t keySize, size_t childCount>
+	struct ChainLeafEntries {
+		template <class Fn>
+		void operator()(size_t, void* leaf, Fn&& fn) const {
+			ChainSplit<keySize, childCount>::forEach(leaf, [&](KeyValueSpot* gotkv) { fn(gotkv->kvp); });
+		}
+	};
+
+	/*Ordered cursor over an integer tree. Slices are taken most significant first, so walking the
+	  children arrays left to right visits keys in ascending order. The cursor keeps the node and
+	  child index of every level in fixed arrays, stepping never allocates, and empty subtrees are
+	  skipped by backing up a level. Only the low keySize bits of a key are stored in the tree.*/
+	template <size_t keySize, size_t childCount>
+	struct TreeCursor {
+		typedef BitNode<keySize, childCount> Node;
+		static constexpr size_t depth = Node::offsetsSize;
+		static constexpr size_t keyMask = keySize >= sizeof(size_t) * CHAR_BIT ? ~(size_t)0 : ((size_t)1 << keySize) - 1;
+
+		Node* _nodes[depth];
+		size_t _index[depth];
+		bool _valid = false;
+
+		bool valid() const {
+			return _valid;
+		}
+
+		size_t key() const {
+			size_t key = 0;
+			for (size_t i = 0; i < depth; ++i)
+			{
+				key |= _index[i] << Node::offsets.offsets[i];
+			}
+			return key;
+		}
+
+		void* value() const {
+			return _nodes[depth - 1]->children[_index[depth - 1]];
+		}
+
+		bool seekFirst(size_t level, size_t from) {
+			Node* node = _nodes[level];
+			for (size_t c = from; c < childCount; ++c)
+			{
+				if (node->children[c] == nullptr) {
+					continue;
+				}
+				_index[level] = c;
+				if (level + 1 == depth) {
+					return true;
+				}
+				_nodes[level + 1] = (Node*)node->children[c];
+				if (seekFirst(level + 1, 0)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool seekLast(size_t level, size_t below) {
+			Node* node = _nodes[level];
+			for (size_t c = below; c > 0; --c)
+			{
+				if (node->children[c - 1] == nullptr) {
+					continue;
+				}
+				_index[level] = c - 1;
+				if (level + 1 == depth) {
+					return true;
+				}
+				_nodes[level + 1] = (Node*)node->children[c - 1];
+				if (seekLast(level + 1, childCount)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		bool seekLower(size_t level, size_t key) {
+			size_t shifted = (key >> Node::offsets.offsets[level]) & Node::bitShift;
+			void* child = _nodes[level]->children[shifted];
+			if (child != nullptr) {
+				_index[level] = shifted;
+				if (level + 1 == depth) {
+					return true;
+				}
+				_nodes[level + 1] = (Node*)child;
+				if (seekLower(level + 1, key)) {
+					return true;
+				}
+			}
+			return seekFirst(level, shifted + 1);
+		}
+
+		bool seekUpper(size_t level, size_t key) {
+			size_t shifted = (key >> Node::offsets.offsets[level]) & Node::bitShift;
+			void* child = _nodes[level]->children[shifted];
+			if (child != nullptr) {
+				_index[level] = shifted;
+				if (level + 1 == depth) {
+					return true;
+				}
+				_nodes[level + 1] = (Node*)child;
+				if (seekUpper(level + 1, key)) {
+					return true;
+				}
+			}
+			return seekLast(level, shifted);
+		}
+
+		void first(Node* tree) {
+			_nodes[0] = tree;
+			_valid = seekFirst(0, 0);
+		}
+
+		void last(Node* tree) {
+			_nodes[0] = tree;
+			_valid = seekLast(0, childCount);
+		}
+
+		/*Moves to the smallest key not below key.*/
+		void lowerBound(Node* tree, size_t key) {
+			_nodes[0] = tree;
+			_valid = (key & ~keyMask) == 0 && seekLower(0, key);
+		}
+
+		/*Moves to the largest key not above key.*/
+		void upperBound(Node* tree, size_t key) {
+			_nodes[0] = tree;
+			_valid = seekUpper(0, (key & ~keyMask) == 0 ? key : keyMask);
+		}
+
+		void next() {
+			for (size_t level = depth; level > 0; --level)
+			{
+				if (seekFirst(level - 1, _index[level - 1] + 1)) {
+					return;
+				}
+			}
+			_valid = false;
+		}
+
+		void prev() {
+			for (size_t level = depth; level > 0; --level)
+			{
+				if (seekLast(level - 1, _index[level - 1])) {
+					return;
+				}
+			}
+			_valid = false;
+		}
+	};
+
+	struct IndexEntry {
+		size_t key;
+		void* value;
+	};
+
+	/*Iterator over a TreeCursor, reverse iterators step with prev instead of next.*/
+	template <size_t keySize, size_t childCount, bool reverse = false>
+	struct TreeIterator {
+		TreeCursor<keySize, childCount> _cursor;
+
+		IndexEntry operator*() const {
+			return IndexEntry{_cursor.key(), _cursor.value()};
+		}
+
+		TreeIterator& operator++() {
+			if (reverse) {
+				_cursor.prev();
+			} else {
+				_cursor.next();
+			}
+			return *this;
+		}
+
+		bool operator==(const TreeIterator& other) const {
+			if (!_cursor.valid() || !other._cursor.valid()) {
+				return _cursor.valid() == other._cursor.valid();
+			}
+			return _cursor.key() == other._cursor.key();
+		}
+
+		bool operator!=(const TreeIterator& other) const {
+			return !(*this == other);
+		}
+	};
+
+	/*Calls callback(key, value) for every key in [lo, hi] in ascending order, stopping early when
+	  the callback returns false.*/
+	template <size_t keySize, size_t childCount, class Callback>
+	void scanInto(BitNode<keySize, childCount>* tree, size_t lo, size_t hi, Callback callback) {
+		TreeCursor<keySize, childCount> cursor;
+		for (cursor.lowerBound(tree, lo); cursor.valid() && cursor.key() <= hi; cursor.next()) {
+			if (!callback(cursor.key(), cursor.value())) {
+				return;
+			}
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	bool isEmptyNode(const BitNode<keySize, childCount>* node) {
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			if (node->children[i] != nullptr) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/*Path from a node at depth down to the last level, kept so the nodes a remove empties can be
+	  pruned bottom up. The node the walk starts from is never pruned, which keeps the root and
+	  the partition nodes in place.*/
+	template <size_t keySize, size_t childCount>
+	struct RemovePath {
+		BitNode<keySize, childCount>* nodes[BitNode<keySize, childCount>::offsetsSize];
+		size_t slots[BitNode<keySize, childCount>::offsetsSize];
+		size_t depth = 0;
+
+		bool walk(BitNode<keySize, childCount>* current, size_t from, size_t key) {
+			depth = from;
+			for (size_t i = from; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+			{
+				nodes[i] = current;
+				slots[i] = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+				current = (BitNode<keySize, childCount>*)current->children[slots[i]];
+				if (current == nullptr) {
+					return false;
+				}
+			}
+			nodes[BitNode<keySize, childCount>::bridgesSize] = current;
+			slots[BitNode<keySize, childCount>::bridgesSize] = (key >> BitNode<keySize, childCount>::offsets.offsets[BitNode<keySize, childCount>::bridgesSize]) & BitNode<keySize, childCount>::bitShift;
+			return true;
+		}
+
+		void*& leaf() {
+			return nodes[BitNode<keySize, childCount>::bridgesSize]->children[slots[BitNode<keySize, childCount>::bridgesSize]];
+		}
+
+		template <class Alloc>
+		void prune(Alloc& alloc) {
+			for (size_t i = BitNode<keySize, childCount>::bridgesSize; i > depth; --i)
+			{
+				if (!isEmptyNode(nodes[i])) {
+					return;
+				}
+				nodes[i - 1]->children[slots[i - 1]] = nullptr;
+				alloc.drop(nodes[i]);
+			}
+		}
+	};
+
+	/*Removes key below current, which sits at depth, and hands emptied nodes back to alloc.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	void* removeIntoAt(BitNode<keySize, childCount>* current, size_t depth, size_t key, Alloc& alloc) {
+		RemovePath<keySize, childCount> path;
+		if (!path.walk(current, depth, key)) {
+			return nullptr;
+		}
+		void* got = path.leaf();
+		if (got != nullptr) {
+			path.leaf() = nullptr;
+			path.prune(alloc);
+		}
+		return got;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void* removeInto(BitNode<keySize, childCount>* tree, size_t key, Alloc& alloc) {
+		return removeIntoAt(tree, 0, key, alloc);
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* removeInto(BitNode<keySize, childCount>* tree, size_t key) {
+		HeapAllocator alloc;
+		return removeInto(tree, key, alloc);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void* removeIntoPart(BitNode<keySize, childCount>* tree, size_t key, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, false);
+		if (current == nullptr) {
+			return nullptr;
+		}
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, false);
+		ScopedPartLock scoped(state, std::adopt_lock);
+		return removeIntoAt(current, i, key, state->alloc);
+	}
+
+	/*Unlinks the chain entry of kvp below current, which sits at depth, and returns its value.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	void* removeHashAt(BitNode<keySize, childCount>* current, size_t depth, size_t key, KeyValuePair* kvp, Alloc& alloc) {
+		typedef ChainSplit<keySize, childCount> Split;
+		RemovePath<keySize, childCount> path;
+		if (!path.walk(current, depth, key)) {
+			return nullptr;
+		}
+		void** splits[Split::maxLevels + 1];
+		size_t level = 0;
+		void** slot = &path.leaf();
+		for (; Split::isSplit(*slot); ++level)
+		{
+			splits[level] = slot;
+			slot = &Split::node(*slot)->children[Split::slot(key, level)];
+		}
+		KeyValueSpot** link = (KeyValueSpot**)slot;
+		while (*link != nullptr) {
+			KeyValueSpot* gotkv = *link;
+			if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
+				void* value = gotkv->kvp->value;
+				*link = gotkv->next;
+				alloc.drop(gotkv);
+				// split nodes left empty go first, then the tree nodes above them
+				while (level > 0 && isEmptyNode(Split::node(*splits[level - 1]))) {
+					level -= 1;
+					alloc.drop(Split::node(*splits[level]));
+					*splits[level] = nullptr;
+				}
+				if (path.leaf() == nullptr) {
+					path.prune(alloc);
+				}
+				return value;
+			}
+			link = &gotkv->next;
+		}
+		return nullptr;
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc>
+	void* removeHash(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, Alloc& alloc) {
+		return removeHashAt(tree, 0, key, kvp, alloc);
+	}
+
+	template <size_t keySize, size_t childCount, class Alloc = HeapAllocator, class Lock = MutexLock>
+	void* removeHashPart(BitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp, size_t levels) {
+		BitNode<keySize, childCount>* current = partitionNode<keySize, childCount, Alloc, Lock>(tree, key, levels, false);
+		if (current == nullptr) {
+			return nullptr;
+		}
+		size_t i = levels;
+		PartitionState<Alloc, Lock>* state = lockPartition<keySize, childCount, Alloc, Lock>(tree, current, i, key, false);
+		ScopedPartLock scoped(state, std::adopt_lock);
+		return removeHashAt(current, i, key, kvp, state->alloc);
+	}
+
+	/*The lock-free functions below must run inside an EpochGuard.*/
+	template <size_t keySize, size_t childCount>
+	AtomicBitNode<keySize, childCount>* descendAtomic(std::atomic<void*>* slot) {
+		void* got = slot->load(std::memory_order_acquire);
+		if (got == nullptr) {
+			AtomicBitNode<keySize, childCount>* fresh = new AtomicBitNode<keySize, childCount>();
+			if (slot->compare_exchange_strong(got, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				return fresh;
+			}
+			// another thread published a node or froze the slot first
+			delete fresh;
+		}
+		if (got == &FROZEN_SLOT) {
+			return nullptr;
+		}
+		return (AtomicBitNode<keySize, childCount>*)got;
+	}
+
+	template <size_t keySize, size_t childCount>
+	AtomicBitNode<keySize, childCount>* descendLeafAtomic(AtomicBitNode<keySize, childCount>* tree, size_t key) {
+		while (true) {
+			AtomicBitNode<keySize, childCount>* current = tree;
+			size_t i = 0;
+			for (; i < BitNode<keySize, childCount>::bridgesSize && current != nullptr; ++i)
+			{
+				size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+				current = descendAtomic<keySize, childCount>(&current->children[shifted]);
+			}
+			if (current != nullptr) {
+				return current;
+			}
+			// ran into a node that is being pruned, let the remover finish unlinking it
+			std::this_thread::yield();
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertIntoAtomic(AtomicBitNode<keySize, childCount>* tree, size_t key, void* data) {
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[BitNode<keySize, childCount>::bridgesSize]) & BitNode<keySize, childCount>::bitShift;
+		while (true) {
+			std::atomic<void*>* slot = &descendLeafAtomic<keySize, childCount>(tree, key)->children[shiftedLast];
+			void* got = slot->load(std::memory_order_acquire);
+			while (got != &FROZEN_SLOT) {
+				if (slot->compare_exchange_weak(got, data, std::memory_order_release, std::memory_order_acquire)) {
+					return;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	/*Chains are immutable once published, a replace or remove copies the spots in front of the
+	  match and swaps the chain head, so readers always see a consistent chain.*/
+	inline KeyValueSpot* copyChainPrefix(KeyValueSpot* head, KeyValueSpot* match, KeyValueSpot* tail) {
+		KeyValueSpot* first = tail;
+		KeyValueSpot** link = &first;
+		for (KeyValueSpot* spot = head; spot != match; spot = spot->next) {
+			KeyValueSpot* copy = new KeyValueSpot();
+			copy->kvp = spot->kvp;
+			*link = copy;
+			link = &copy->next;
+		}
+		*link = tail;
+		return first;
+	}
+
+	inline void deleteChainPrefix(KeyValueSpot* head, KeyValueSpot* stop) {
+		while (head != stop) {
+			KeyValueSpot* next = head->next;
+			delete head;
+			head = next;
+		}
+	}
+
+	inline void retireChainPrefix(KeyValueSpot* head, KeyValueSpot* stop) {
+		while (head != stop) {
+			KeyValueSpot* next = head->next;
+			Epoch::retire(head, deleteRetired<KeyValueSpot>);
+			head = next;
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertHashAtomic(AtomicBitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[BitNode<keySize, childCount>::bridgesSize]) & BitNode<keySize, childCount>::bitShift;
+		KeyValueSpot* newkvs = nullptr;
+		while (true) {
+			std::atomic<void*>* slot = &descendLeafAtomic<keySize, childCount>(tree, key)->children[shiftedLast];
+			void* head = slot->load(std::memory_order_acquire);
+			while (head != &FROZEN_SLOT) {
+				KeyValueSpot* gotkv = (KeyValueSpot*)head;
+				while (gotkv != nullptr && std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) != 0) {
+					gotkv = gotkv->next;
+				}
+				if (gotkv != nullptr) {
+					KeyValueSpot* replaced = new KeyValueSpot();
+					replaced->kvp = kvp;
+					replaced->next = gotkv->next;
+					KeyValueSpot* newHead = copyChainPrefix((KeyValueSpot*)head, gotkv, replaced);
+					if (slot->compare_exchange_strong(head, newHead, std::memory_order_release, std::memory_order_acquire)) {
+						retireChainPrefix((KeyValueSpot*)head, gotkv->next);
+						delete newkvs;
+						return;
+					}
+					deleteChainPrefix(newHead, replaced->next);
+					continue;
+				}
+				if (newkvs == nullptr) {
+					newkvs = new KeyValueSpot();
+					newkvs->kvp = kvp;
+				}
+				newkvs->next = (KeyValueSpot*)head;
+				// on failure head is reloaded, so the chain is rescanned for a racing insert of the same key
+				if (slot->compare_exchange_weak(head, newkvs, std::memory_order_release, std::memory_order_acquire)) {
+					return;
+				}
+			}
+			std::this_thread::yield();
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findIntoAtomic(AtomicBitNode<keySize, childCount>* tree, size_t key) {
+		AtomicBitNode<keySize, childCount>* current = tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			void* got = current->children[shifted].load(std::memory_order_acquire);
+			if (got == nullptr || got == &FROZEN_SLOT) {
+				return nullptr;
+			}
+			current = (AtomicBitNode<keySize, childCount>*)got;
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		void* got = current->children[shiftedLast].load(std::memory_order_acquire);
+		return got == &FROZEN_SLOT ? nullptr : got;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findHashAtomic(AtomicBitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
+		AtomicBitNode<keySize, childCount>* current = tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			void* got = current->children[shifted].load(std::memory_order_acquire);
+			if (got == nullptr || got == &FROZEN_SLOT) {
+				return nullptr;
+			}
+			current = (AtomicBitNode<keySize, childCount>*)got;
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+		void* head = current->children[shiftedLast].load(std::memory_order_acquire);
+		KeyValueSpot* gotkv = head == &FROZEN_SLOT ? nullptr : (KeyValueSpot*)head;
+		while (gotkv != nullptr) {
+			if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
+				return gotkv->kvp->value;
+			}
+			gotkv = gotkv->next;
+		}
+		return nullptr;
+	}
+
+	/*Freezes every empty slot of node so no insert can land in it, then unlinks it from its parent.
+	  Fails and thaws the node again if any slot is in use.*/
+	template <size_t keySize, size_t childCount>
+	bool pruneAtomic(AtomicBitNode<keySize, childCount>* node, std::atomic<void*>* parentSlot) {
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* expected = nullptr;
+			if (!node->children[i].compare_exchange_strong(expected, &FROZEN_SLOT, std::memory_order_acq_rel)) {
+				for (size_t j = 0; j < i; ++j)
+				{
+					node->children[j].store(nullptr, std::memory_order_release);
+				}
+				return false;
+			}
+		}
+		// a parent slot that points at a live node can only be changed by the thread that froze that node
+		parentSlot->store(nullptr, std::memory_order_release);
+		Epoch::retire(node, deleteRetired<AtomicBitNode<keySize, childCount>>);
+		return true;
+	}
+
+	template <size_t keySize, size_t childCount>
+	struct AtomicPath {
+		AtomicBitNode<keySize, childCount>* nodes[BitNode<keySize, childCount>::offsetsSize];
+		std::atomic<void*>* slots[BitNode<keySize, childCount>::offsetsSize];
+
+		// walks down to the node holding the leaf slot for key, false if some level is missing
+		bool walk(AtomicBitNode<keySize, childCount>* tree, size_t key) {
+			nodes[0] = tree;
+			slots[0] = nullptr;
+			for (size_t i = 0; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+			{
+				size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+				void* got = nodes[i]->children[shifted].load(std::memory_order_acquire);
+				if (got == nullptr || got == &FROZEN_SLOT) {
+					return false;
+				}
+				slots[i + 1] = &nodes[i]->children[shifted];
+				nodes[i + 1] = (AtomicBitNode<keySize, childCount>*)got;
+			}
+			return true;
+		}
+
+		// prunes emptied nodes bottom up, the root is never unlinked
+		void prune() {
+			for (size_t i = BitNode<keySize, childCount>::bridgesSize; i > 0; --i)
+			{
+				if (!pruneAtomic<keySize, childCount>(nodes[i], slots[i])) {
+					return;
+				}
+			}
+		}
+	};
+
+	template <size_t keySize, size_t childCount>
+	void* removeIntoAtomic(AtomicBitNode<keySize, childCount>* tree, size_t key) {
+		AtomicPath<keySize, childCount> path;
+		if (!path.walk(tree, key)) {
+			return nullptr;
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[BitNode<keySize, childCount>::bridgesSize]) & BitNode<keySize, childCount>::bitShift;
+		std::atomic<void*>* slot = &path.nodes[BitNode<keySize, childCount>::bridgesSize]->children[shiftedLast];
+		void* got = slot->load(std::memory_order_acquire);
+		do {
+			if (got == nullptr || got == &FROZEN_SLOT) {
+				return nullptr;
+			}
+		} while (!slot->compare_exchange_weak(got, nullptr, std::memory_order_acq_rel, std::memory_order_acquire));
+		path.prune();
+		return got;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* removeHashAtomic(AtomicBitNode<keySize, childCount>* tree, size_t key, KeyValuePair* kvp) {
+		AtomicPath<keySize, childCount> path;
+		if (!path.walk(tree, key)) {
+			return nullptr;
+		}
+		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[BitNode<keySize, childCount>::bridgesSize]) & BitNode<keySize, childCount>::bitShift;
+		std::atomic<void*>* slot = &path.nodes[BitNode<keySize, childCount>::bridgesSize]->children[shiftedLast];
+		void* head = slot->load(std::memory_order_acquire);
+		while (true) {
+			if (head == nullptr || head == &FROZEN_SLOT) {
+				return nullptr;
+			}
+			KeyValueSpot* gotkv = (KeyValueSpot*)head;
+			while (gotkv != nullptr && std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) != 0) {
+				gotkv = gotkv->next;
+			}
+			if (gotkv == nullptr) {
+				return nullptr;
+			}
+			KeyValueSpot* newHead = copyChainPrefix((KeyValueSpot*)head, gotkv, gotkv->next);
+			if (slot->compare_exchange_strong(head, newHead, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				void* value = gotkv->kvp->value;
+				retireChainPrefix((KeyValueSpot*)head, gotkv->next);
+				if (newHead == nullptr) {
+					path.prune();
+				}
+				return value;
+			}
+			deleteChainPrefix(newHead, gotkv->next);
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void freeAtomicSubtree(AtomicBitNode<keySize, childCount>* tree, size_t depth, LeafKind kind) {
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = tree->children[i].load(std::memory_order_acquire);
+			if (child == nullptr || child == &FROZEN_SLOT) {
+				continue;
+			}
+			if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				freeAtomicSubtree((AtomicBitNode<keySize, childCount>*)child, depth + 1, kind);
+				delete (AtomicBitNode<keySize, childCount>*)child;
+			} else if (kind == CHAIN_LEAVES) {
+				deleteChainPrefix((KeyValueSpot*)child, nullptr);
+			}
+			tree->children[i].store(nullptr, std::memory_order_relaxed);
+		}
+	}
+
+	/*Per tree or per partition stats. Sizes, depth occupancy and chain lengths come from walking the
+	  nodes when the stats are taken, so they cost nothing until asked for. Lock and lookup counts
+	  come from the event counters and read 0 when those are compiled out.*/
+	struct TreeStats {
+		static constexpr size_t maxDepth = 16;
+		static constexpr size_t chainBuckets = 8;
+		size_t nodes = 0;
+		size_t nodeBytes = 0;
+		size_t leafBytes = 0;
+		size_t entries = 0;
+		// nodes found at each depth, the root is depth 0
+		size_t depthNodes[maxDepth] = {0};
+		// used leaf slots by how many entries they hold, the last bucket also counts longer chains
+		size_t chainLengths[chainBuckets] = {0};
+		size_t lockAcquisitions = 0;
+		size_t lockContended = 0;
+		size_t lockWaitNanos = 0;
+		size_t hits = 0;
+		size_t misses = 0;
+
+		size_t bytes() const {
+			return nodeBytes + leafBytes;
+		}
+
+		// entries that share a leaf slot with an earlier one
+		size_t collisions() const {
+			size_t slots = 0;
+			for (size_t i = 0; i < chainBuckets; ++i)
+			{
+				slots += chainLengths[i];
+			}
+			return entries - slots;
+		}
+
+		void addNode(size_t depth, size_t size) {
+			nodes += 1;
+			nodeBytes += size;
+			depthNodes[depth < maxDepth ? depth : maxDepth - 1] += 1;
+		}
+
+		void addChain(size_t length) {
+			if (length == 0) {
+				return;
+			}
+			entries += length;
+			chainLengths[(length < chainBuckets ? length : chainBuckets) - 1] += 1;
+		}
+
+		void addCounters(const PartitionCounters& counters) {
+			lockAcquisitions += counters.lockAcquisitions.get();
+			lockContended += counters.lockContended.get();
+			lockWaitNanos += counters.lockWaitNanos.get();
+			hits += counters.hits.get();
+			misses += counters.misses.get();
+		}
+
+		void merge(const TreeStats& other) {
+			nodes += other.nodes;
+			nodeBytes += other.nodeBytes;
+			leafBytes += other.leafBytes;
+			entries += other.entries;
+			for (size_t i = 0; i < maxDepth; ++i)
+			{
+				depthNodes[i] += other.depthNodes[i];
+			}
+			for (size_t i = 0; i < chainBuckets; ++i)
+			{
+				chainLengths[i] += other.chainLengths[i];
+			}
+			lockAcquisitions += other.lockAcquisitions;
+			lockContended += other.lockContended;
+			lockWaitNanos += other.lockWaitNanos;
+			hits += other.hits;
+			misses += other.misses;
+		}
+
+		void writeJson(FILE* out) const {
+			std::fprintf(out, "{\"nodes\":%zu,\"nodeBytes\":%zu,\"leafBytes\":%zu,\"entries\":%zu,\"depthNodes\":[", nodes, nodeBytes, leafBytes, entries);
+			for (size_t i = 0; i < maxDepth; ++i)
+			{
+				std::fprintf(out, i == 0 ? "%zu" : ",%zu", depthNodes[i]);
+			}
+			std::fprintf(out, "],\"chainLengths\":[");
+			for (size_t i = 0; i < chainBuckets; ++i)
+			{
+				std::fprintf(out, i == 0 ? "%zu" : ",%zu", chainLengths[i]);
+			}
+			std::fprintf(out, "],\"lockAcquisitions\":%zu,\"lockContended\":%zu,\"lockWaitNanos\":%zu,\"hits\":%zu,\"misses\":%zu}",
+				lockAcquisitions, lockContended, lockWaitNanos, hits, misses);
+		}
+	};
+
+	/*Stats of a whole tree, with one entry per partition for the partitioned trees.*/
+	struct StatsReport {
+		TreeStats total;
+		std::vector<TreeStats> partitions;
+
+		void writeJson(FILE* out) const {
+			std::fprintf(out, "{\"total\":");
+			total.writeJson(out);
+			std::fprintf(out, ",\"partitions\":[");
+			for (size_t i = 0; i < partitions.size(); ++i)
+			{
+				if (i > 0) {
+					std::fprintf(out, ",");
+				}
+				partitions[i].writeJson(out);
+			}
+			std::fprintf(out, "]}\n");
+		}
+	};
+
+	/*Lookup counters of a tree without partitions, any number of readers may bump them.*/
+	struct TreeCounters {
+		ShardedStatCount hits;
+		ShardedStatCount misses;
+
+		void recordFind(const void* found) {
+			if (found != nullptr) {
+				hits.add();
+			} else {
+				misses.add();
+			}
+		}
+
+		void fill(TreeStats& stats) const {
+			stats.hits += hits.get();
+			stats.misses += misses.get();
+		}
+	};
+
+	/*Counts a chain slot, the nodes of a split chain count as levels below the tree's own.*/
+	template <size_t keySize, size_t childCount>
+	void statChain(void* leaf, size_t depth, TreeStats& stats) {
+		typedef ChainSplit<keySize, childCount> Split;
+		if (Split::isSplit(leaf)) {
+			stats.addNode(depth, sizeof(BitNode<keySize, childCount>));
+			for (size_t i = 0; i < childCount; ++i)
+			{
+				void* child = Split::node(leaf)->children[i];
+				if (child != nullptr) {
+					statChain<keySize, childCount>(child, depth + 1, stats);
+				}
+			}
+			return;
+		}
+		size_t length = 0;
+		for (KeyValueSpot* gotkv = (KeyValueSpot*)leaf; gotkv != nullptr; gotkv = gotkv->next) {
+			stats.leafBytes += sizeof(KeyValueSpot);
+			length += 1;
+		}
+		stats.addChain(length);
+	}
+
+	template <size_t keySize, size_t childCount>
+	void statSubtree(BitNode<keySize, childCount>* tree, size_t depth, LeafKind kind, TreeStats& stats) {
+		stats.addNode(depth, sizeof(BitNode<keySize, childCount>));
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = tree->children[i];
+			if (child == nullptr) {
+				continue;
+			}
+			size_t length = 0;
+			if (kind == BUCKET_LEAVES && depth + 1 == BitNode<keySize, childCount>::bridgesSize) {
+				for (LeafBucket* bucket = (LeafBucket*)child; bucket != nullptr; bucket = bucket->overflow) {
+					stats.leafBytes += sizeof(LeafBucket);
+					length += popCount(bucket->tags & LeafBucket::highBits);
+				}
+			} else if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				statSubtree((BitNode<keySize, childCount>*)child, depth + 1, kind, stats);
+				continue;
+			} else if (kind == VALUE_LEAVES) {
+				length = 1;
+			} else if (kind == CHAIN_LEAVES) {
+				statChain<keySize, childCount>(child, depth + 1, stats);
+				continue;
+			} else if (kind == BLOB_LEAVES) {
+				for (KeyBlobSpot* spot = (KeyBlobSpot*)child; spot != nullptr; spot = spot->next) {
+					stats.leafBytes += sizeof(KeyBlobSpot) + spot->len;
+					length += 1;
+				}
+			}
+			stats.addChain(length);
+		}
+	}
+
+	/*Walks a partitioned tree, each partition is walked under its own lock. A split partition
+	  counts as its node plus one partition per child.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock = MutexLock>
+	void statParitions(BitNode<keySize, childCount>* tree, size_t level, size_t depth, LeafKind kind, StatsReport& report) {
+		if (level == 0) {
+			PartitionState<Alloc, Lock>* state = (PartitionState<Alloc, Lock>*)tree->lock;
+			TreeStats part;
+			{
+				// taken on the mutex itself so the walk does not show up in the lock counters
+				std::lock_guard<Lock> scoped(state->mux);
+				if (!state->split.load(std::memory_order_relaxed)) {
+					statSubtree(tree, depth, kind, part);
+				} else {
+					part.addNode(depth, sizeof(BitNode<keySize, childCount>));
+				}
+				part.addCounters(state->counters);
+			}
+			report.total.merge(part);
+			report.partitions.push_back(part);
+			if (state->split.load(std::memory_order_acquire)) {
+				for (size_t i = 0; i < childCount; ++i)
+				{
+					statParitions<keySize, childCount, Alloc, Lock>((BitNode<keySize, childCount>*)tree->children[i], 0, depth + 1, kind, report);
+				}
+			}
+			return;
+		}
+		report.total.addNode(depth, sizeof(BitNode<keySize, childCount>));
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			BitNode<keySize, childCount>* child = (BitNode<keySize, childCount>*)loadSlot(&tree->children[i]);
+			if (child != nullptr) {
+				statParitions<keySize, childCount, Alloc, Lock>(child, level - 1, depth + 1, kind, report);
+			}
+		}
+	}
+
+	/*What a compaction gave back. Allocators that do not own their memory are counted by the
+	  bytes the tree holds, so they never show anything reclaimed. bytesPinned is the part of
+	  bytesAfter that stayed in place, see compactParitions.*/
+	struct CompactReport {
+		size_t bytesBefore = 0;
+		size_t bytesAfter = 0;
+		size_t bytesPinned = 0;
+
+		size_t reclaimed() const {
+			return bytesBefore > bytesAfter ? bytesBefore - bytesAfter : 0;
+		}
+
+		void merge(const CompactReport& other) {
+			bytesBefore += other.bytesBefore;
+			bytesAfter += other.bytesAfter;
+			bytesPinned += other.bytesPinned;
+		}
+	};
+
+	/*Copies the subtree below a node into a fresh allocator in lookup order. The first bfsLevels
+	  levels are laid out breadth first, so the nodes every lookup passes through share pages, and
+	  each subtree below them depth first, a node right before its children and chain entries
+	  right after their slot's node.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	struct TreeCompactor {
+		typedef BitNode<keySize, childCount> Node;
+		typedef ChainSplit<keySize, childCount> Split;
+		static constexpr size_t bfsLevels = 2;
+		LeafKind kind;
+		Alloc& to;
+
+		static size_t leafBytes(void* leaf, LeafKind kind) {
+			if (kind != CHAIN_LEAVES) {
+				return 0;
+			}
+			size_t bytes = 0;
+			if (Split::isSplit(leaf)) {
+				bytes += sizeof(Node);
+				for (size_t i = 0; i < childCount; ++i)
+				{
+					bytes += leafBytes(Split::node(leaf)->children[i], kind);
+				}
+				return bytes;
+			}
+			for (KeyValueSpot* gotkv = (KeyValueSpot*)leaf; gotkv != nullptr; gotkv = gotkv->next) {
+				bytes += sizeof(KeyValueSpot);
+			}
+			return bytes;
+		}
+
+		/*Bytes the copy of everything below tree, which sits at depth, takes.*/
+		static size_t subtreeBytes(const Node* tree, size_t depth, LeafKind kind) {
+			size_t bytes = 0;
+			for (size_t i = 0; i < childCount; ++i)
+			{
+				void* child = tree->children[i];
+				if (child == nullptr) {
+					continue;
+				}
+				if (depth < Node::bridgesSize) {
+					bytes += sizeof(Node) + subtreeBytes((const Node*)child, depth + 1, kind);
+				} else {
+					bytes += leafBytes(child, kind);
+				}
+			}
+			return bytes;
+		}
+
+		void* copyLeaf(void* leaf) {
+			if (kind != CHAIN_LEAVES || leaf == nullptr) {
+				return leaf;
+			}
+			if (Split::isSplit(leaf)) {
+				Node* fan = to.template make<Node>();
+				for (size_t i = 0; i < childCount; ++i)
+				{
+					fan->children[i] = copyLeaf(Split::node(leaf)->children[i]);
+				}
+				return Split::tag(fan);
+			}
+			void* head = nullptr;
+			void** link = &head;
+			for (KeyValueSpot* gotkv = (KeyValueSpot*)leaf; gotkv != nullptr; gotkv = gotkv->next) {
+				KeyValueSpot* copy = to.template make<KeyValueSpot>();
+				copy->kvp = gotkv->kvp;
+				*link = copy;
+				link = (void**)&copy->next;
+			}
+			return head;
+		}
+
+		void copyDepthFirst(const Node* from, Node* into, size_t depth) {
+			for (size_t i = 0; i < childCount; ++i)
+			{
+				void* child = from->children[i];
+				if (child == nullptr) {
+					continue;
+				}
+				if (depth < Node::bridgesSize) {
+					Node* copy = to.template make<Node>();
+					into->children[i] = copy;
+					copyDepthFirst((const Node*)child, copy, depth + 1);
+				} else {
+					into->children[i] = copyLeaf(child);
+				}
+			}
+		}
+
+		/*Fills into's children with a copy of from's, from sits at depth.*/
+		void copy(const Node* from, Node* into, size_t depth) {
+			std::vector<std::pair<const Node*, Node*>> level{{from, into}};
+			std::vector<std::pair<const Node*, Node*>> next;
+			for (size_t d = depth; d < depth + bfsLevels && d < Node::bridgesSize; ++d)
+			{
+				next.clear();
+				for (const std::pair<const Node*, Node*>& at : level) {
+					for (size_t i = 0; i < childCount; ++i)
+					{
+						if (at.first->children[i] != nullptr) {
+							Node* copy = to.template make<Node>();
+							at.second->children[i] = copy;
+							next.emplace_back((const Node*)at.first->children[i], copy);
+						}
+					}
+				}
+				level.swap(next);
+				depth = d + 1;
+			}
+			for (const std::pair<const Node*, Node*>& at : level) {
+				copyDepthFirst(at.first, at.second, depth);
+			}
+		}
+	};
+
+	/*Rebuilds everything below tree, which sits at depth, in one region of a new allocator and
+	  hands the new allocator to alloc. tree itself stays where it is, only its children change,
+	  so the caller must keep every other user of the subtree out meanwhile.*/
+	template <size_t keySize, size_t childCount, class Alloc>
+	CompactReport compactSubtree(BitNode<keySize, childCount>* tree, size_t depth, LeafKind kind, Alloc& alloc) {
+		typedef TreeCompactor<keySize, childCount, Alloc> Compactor;
+		CompactReport report;
+		size_t bytes = Compactor::subtreeBytes(tree, depth, kind);
+		if (bytes == 0) {
+			// nothing to copy, the old slabs go without a new one being made for the copy
+			if constexpr (Alloc::ownsMemory) {
+				report.bytesBefore = alloc.footprint();
+				Alloc empty;
+				alloc.swap(empty);
+			}
+			return report;
+		}
+		Alloc fresh;
+		fresh.reserve(bytes);
+		BitNode<keySize, childCount> copy;
+		Compactor{kind, fresh}.copy(tree, &copy, depth);
+		if constexpr (Alloc::ownsMemory) {
+			report.bytesBefore = alloc.footprint();
+			report.bytesAfter = fresh.footprint();
+		} else {
+			report.bytesBefore = bytes;
+			report.bytesAfter = bytes;
+			freeSubtree(tree, depth, kind, alloc);
+		}
+		std::memcpy(tree->children, copy.children, sizeof(copy.children));
+		// the old nodes go away with fresh
+		alloc.swap(fresh);
+		return report;
+	}
+
+	/*Compacts each partition of a partitioned tree in turn under its write lock, so the rest of
+	  the tree keeps serving meanwhile. Split partitions hand the work to their children, which
+	  copy the nodes made before the split out of the split partition's allocator. That allocator
+	  still holds the child partition nodes, which walkers pass through without a lock, so they
+	  can not move, and a slab allocator keeps all of its slabs. Those count as bytesPinned.*/
+	template <size_t keySize, size_t childCount, class Alloc, class Lock>
+	void compactParitions(BitNode<keySize, childCount>* tree, size_t level, size_t depth, LeafKind kind, CompactReport& report) {
+		if (level == 0) {
+			PartitionState<Alloc, Lock>* state = (PartitionState<Alloc, Lock>*)tree->lock;
+			ScopedPartLock scoped(state);
+			if (!state->split.load(std::memory_order_relaxed)) {
+				report.merge(compactSubtree(tree, depth, kind, state->alloc));
+				return;
+			}
+			if constexpr (Alloc::ownsMemory) {
+				size_t kept = state->alloc.footprint();
+				report.bytesBefore += kept;
+				report.bytesAfter += kept;
+				report.bytesPinned += kept;
+			}
+			for (size_t i = 0; i < childCount; ++i)
+			{
+				compactParitions<keySize, childCount, Alloc, Lock>((BitNode<keySize, childCount>*)tree->children[i], 0, depth + 1, kind, report);
+			}
+			return;
+		}
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			BitNode<keySize, childCount>* child = (BitNode<keySize, childCount>*)loadSlot(&tree->children[i]);
+			if (child != nullptr) {
+				compactParitions<keySize, childCount, Alloc, Lock>(child, level - 1, depth + 1, kind, report);
+			}
+		}
+	}
+
+	/*Huge page use of every allocator of a partitioned tree, one pass over smaps for all of them.
+	  Each partition's slabs are read under its lock.*/
+	template <class Alloc, class Lock>
+	HugePageReport partitionHugePages(PartitionTable<Alloc, Lock>& table) {
+		SlabRanges ranges;
+		size_t bytes = 0;
+		std::vector<PartitionState<Alloc, Lock>*> states;
+		{
+			std::lock_guard<std::mutex> guard(table.growMux);
+			table.alloc->slabRanges(ranges);
+			for (size_t i = 0; i < table.used; ++i)
+			{
+				states.push_back(&table.chunks[i / table.chunkSize][i % table.chunkSize]);
+			}
+		}
+		// a split takes the partition lock before growMux, so the states are locked after it is let go
+		for (PartitionState<Alloc, Lock>* state : states) {
+			std::lock_guard<Lock> scoped(state->mux);
+			state->alloc.slabRanges(ranges);
+		}
+		for (const std::pair<uintptr_t, size_t>& range : ranges) {
+			bytes += range.second;
+		}
+		HugePageReport report = Alloc::SlabSource::hugePages(ranges);
+		report.slabBytes = bytes;
+		return report;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void statCompactSubtree(CompactBitNode<keySize, childCount>* tree, size_t depth, LeafKind kind, TreeStats& stats) {
+		stats.addNode(depth, CompactBitNode<keySize, childCount>::bytesFor(tree->capacity));
+		void** slots = tree->slots();
+		size_t count = popCount(tree->bitmap);
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (slots[i] == nullptr) {
+				continue;
+			}
+			if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				statCompactSubtree((CompactBitNode<keySize, childCount>*)slots[i], depth + 1, kind, stats);
+			} else if (kind == CHAIN_LEAVES) {
+				size_t length = 0;
+				for (KeyValueSpot* gotkv = (KeyValueSpot*)slots[i]; gotkv != nullptr; gotkv = gotkv->next) {
+					stats.leafBytes += sizeof(KeyValueSpot);
+					length += 1;
+				}
+				stats.addChain(length);
+			} else {
+				stats.addChain(1);
+			}
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void statSlimSubtree(const SlimStore<keySize, childCount>& store, uint32_t node, size_t depth, LeafKind kind, TreeStats& stats) {
+		stats.addNode(depth, sizeof(SlimBitNode<keySize, childCount>));
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			uint32_t ref = store.nodes[node].children[i];
+			if (ref == 0) {
+				continue;
+			}
+			if ((ref & slimLeafTag) == 0) {
+				statSlimSubtree(store, ref, depth + 1, kind, stats);
+				continue;
+			}
+			if (kind == VALUE_LEAVES) {
+				stats.addNode(depth + 1, sizeof(typename SlimStore<keySize, childCount>::ValueNode));
+				for (void* value : store.values[ref & ~slimLeafTag].values) {
+					if (value != nullptr) {
+						stats.addChain(1);
+					}
+				}
+				continue;
+			}
+			size_t length = 0;
+			for (; ref != 0; ref = store.leaves[ref & ~slimLeafTag].next) {
+				stats.leafBytes += sizeof(SlimLeaf);
+				length += 1;
+			}
+			stats.addChain(length);
+		}
+	}
+
+	/*Must run inside an EpochGuard, retired nodes are not counted.*/
+	template <size_t keySize, size_t childCount>
+	void statAtomicSubtree(AtomicBitNode<keySize, childCount>* tree, size_t depth, LeafKind kind, TreeStats& stats) {
+		stats.addNode(depth, sizeof(AtomicBitNode<keySize, childCount>));
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = tree->children[i].load(std::memory_order_acquire);
+			if (child == nullptr || child == &FROZEN_SLOT) {
+				continue;
+			}
+			if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				statAtomicSubtree((AtomicBitNode<keySize, childCount>*)child, depth + 1, kind, stats);
+			} else if (kind == CHAIN_LEAVES) {
+				size_t length = 0;
+				for (KeyValueSpot* gotkv = (KeyValueSpot*)child; gotkv != nullptr; gotkv = gotkv->next) {
+					stats.leafBytes += sizeof(KeyValueSpot);
+					length += 1;
+				}
+				stats.addChain(length);
+			} else {
+				stats.addChain(1);
+			}
+		}
+	}
+
+	/*Snapshots are flat images of a tree. Every node is childCount 64 bit words holding the file
+	  offset of a child, 0 for none, so the image can be mapped anywhere and read in place. The last
+	  level holds raw value words for value leaves, or the offset of a chain record, a count
+	  followed by that many SnapshotPairs, for chain leaves. Values are written as their pointer
+	  bits, which only survive a restart when they are integers or handles rather than addresses.*/
+	struct SnapshotHeader {
+		static constexpr uint64_t magicWord = 0x31504E5354544E46ULL; // "FNTTSNP1"
+		static constexpr uint64_t byteOrderWord = 0x0102030405060708ULL;
+		uint64_t magic = magicWord;
+		uint64_t byteOrder = byteOrderWord;
+		uint64_t kind = 0;
+		uint64_t keySize = 0;
+		uint64_t childCount = 0;
+		uint64_t root = 0;
+		uint64_t size = 0;
+		uint64_t reserved = 0;
+	};
+
+	struct SnapshotPair {
+		unsigned char key[sizeof(KeyValuePair::key)];
+		uint64_t value;
+	};
+
+	struct SnapshotWriter {
+		FILE* _file;
+		uint64_t _offset = 0;
+		bool _ok = true;
+
+		uint64_t write(const void* data, size_t len) {
+			uint64_t at = _offset;
+			if (std::fwrite(data, 1, len, _file) != len) {
+				_ok = false;
+			}
+			_offset += len;
+			return at;
+		}
+	};
+
+	/*Writes the children of node before node itself and returns its offset, 0 for an empty subtree.*/
+	template <size_t keySize, size_t childCount>
+	uint64_t writeSnapshotNode(SnapshotWriter& out, BitNode<keySize, childCount>* node, size_t depth, LeafKind kind) {
+		uint64_t refs[childCount];
+		bool any = false;
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = node->children[i];
+			refs[i] = 0;
+			if (child == nullptr) {
+				continue;
+			}
+			if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				refs[i] = writeSnapshotNode(out, (BitNode<keySize, childCount>*)child, depth + 1, kind);
+			} else if (kind == VALUE_LEAVES) {
+				refs[i] = (uint64_t)(uintptr_t)child;
+			} else {
+				// a split chain is written back as one chain
+				uint64_t count = 0;
+				ChainSplit<keySize, childCount>::forEach(child, [&](KeyValueSpot*) { count += 1; });
+				refs[i] = out.write(&count, sizeof(count));
+				ChainSplit<keySize, childCount>::forEach(child, [&](KeyValueSpot* gotkv) {
+					SnapshotPair pair;
+					std::memcpy(pair.key, gotkv->kvp->key, sizeof(pair.key));
+					pair.value = (uint64_t)(uintptr_t)gotkv->kvp->value;
+					out.write(&pair, sizeof(pair));
+				});
+			}
+			any = any || refs[i] != 0;
+		}
+		if (!any && depth > 0) {
+			return 0;
+		}
+		return out.write(refs, sizeof(refs));
+	}
+
+	/*Writes tree to path. Writers must be kept out of the tree while it is saved.*/
+	template <size_t keySize, size_t childCount>
+	bool saveSnapshot(BitNode<keySize, childCount>* tree, const char* path, LeafKind kind) {
+		FILE* file = std::fopen(path, "wb");
+		if (file == nullptr) {
+			return false;
+		}
+		SnapshotWriter out{file};
+		SnapshotHeader header;
+		header.kind = kind;
+		header.keySize = keySize;
+		header.childCount = childCount;
+		out.write(&header, sizeof(header));
+		header.root = writeSnapshotNode(out, tree, 0, kind);
+		header.size = out._offset;
+		bool ok = out._ok && std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1;
+		return std::fclose(file) == 0 && ok;
+	}
+
+	/*Read only tree over a mapped snapshot. Pages are faulted in as lookups touch them, so the
+	  view is usable as soon as it is open, whatever the size of the image.*/
+	template <size_t keySize, size_t childCount>
+	struct SnapshotView {
+		typedef BitNode<keySize, childCount> Node;
+		const char* _base = nullptr;
+		size_t _size = 0;
+
+		SnapshotView() {}
+		SnapshotView(const SnapshotView&) = delete;
+		SnapshotView& operator=(const SnapshotView&) = delete;
+
+		~SnapshotView() {
+			close();
+		}
+
+		bool openView(const char* path, LeafKind kind) {
+			close();
+		#if defined(FNTREE_HAS_MMAP)
+			int fd = ::open(path, O_RDONLY);
+			if (fd < 0) {
+				return false;
+			}
+			struct stat info;
+			if (::fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader)) {
+				::close(fd);
+				return false;
+			}
+			void* mem = ::mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			::close(fd);
+			if (mem == MAP_FAILED) {
+				return false;
+			}
+			_base = (const char*)mem;
+			_size = (size_t)info.st_size;
+			const SnapshotHeader* header = (const SnapshotHeader*)_base;
+			if (header->magic != SnapshotHeader::magicWord || header->byteOrder != SnapshotHeader::byteOrderWord ||
+				header->kind != (uint64_t)kind || header->keySize != keySize || header->childCount != childCount ||
+				header->size != _size || header->root + sizeof(uint64_t) * childCount > _size) {
+				close();
+				return false;
+			}
+			return true;
+		#else
+			(void)path;
+			(void)kind;
+			return false;
+		#endif
+		}
+
+		void close() {
+		#if defined(FNTREE_HAS_MMAP)
+			if (_base != nullptr) {
+				::munmap((void*)_base, _size);
+			}
+		#endif
+			_base = nullptr;
+			_size = 0;
+		}
+
+		bool isOpen() const {
+			return _base != nullptr;
+		}
+
+		/*The last level word for key, 0 when the path to it is missing.*/
+		uint64_t leafRef(size_t key) const {
+			const uint64_t* node = (const uint64_t*)(_base + ((const SnapshotHeader*)_base)->root);
+			size_t i = 0;
+			for (; i < Node::bridgesSize; ++i)
+			{
+				uint64_t ref = node[(key >> Node::offsets.offsets[i]) & Node::bitShift];
+				if (ref == 0) {
+					return 0;
+				}
+				node = (const uint64_t*)(_base + ref);
+			}
+			return node[(key >> Node::offsets.offsets[i]) & Node::bitShift];
+		}
+	};
+
+	/*Reference counted node for copy-on-write trees. Every parent and every version root holds
+	  one reference, a node is only written in place while it has a single one.*/
+	template <size_t keySize, size_t childCount>
+	struct SharedBitNode {
+		std::atomic<size_t> refs{1};
+		void* children[childCount] = {nullptr};
+	};
+
+	/*Immutable collision chain of a copy-on-write map, replaced as a whole on insert.*/
+	struct SharedChain {
+		std::atomic<size_t> refs{1};
+		size_t count = 0;
+		KeyValuePair* kvps[1];
+
+		static size_t bytesFor(size_t count) {
+			return sizeof(SharedChain) + (count - 1) * sizeof(KeyValuePair*);
+		}
+
+		/*Copy of chain with kvp replacing the pair of the same key, or added to the end.*/
+		static SharedChain* make(const SharedChain* chain, KeyValuePair* kvp) {
+			size_t count = chain == nullptr ? 0 : chain->count;
+			size_t at = count;
+			for (size_t i = 0; i < count; ++i)
+			{
+				if (std::memcmp(chain->kvps[i]->key, kvp->key, sizeof(kvp->key)) == 0) {
+					at = i;
+					break;
+				}
+			}
+			size_t newCount = at == count ? count + 1 : count;
+			SharedChain* made = new (::operator new(bytesFor(newCount))) SharedChain();
+			made->count = newCount;
+			for (size_t i = 0; i < count; ++i)
+			{
+				made->kvps[i] = chain->kvps[i];
+			}
+			made->kvps[at] = kvp;
+			return made;
+		}
+
+		static void release(SharedChain* chain) {
+			if (chain->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				chain->~SharedChain();
+				::operator delete(chain);
+			}
+		}
+	};
+
+	template <size_t keySize, size_t childCount>
+	void retainShared(void* child, size_t depth, LeafKind kind) {
+		if (depth <= BitNode<keySize, childCount>::bridgesSize) {
+			((SharedBitNode<keySize, childCount>*)child)->refs.fetch_add(1, std::memory_order_relaxed);
+		} else if (kind == CHAIN_LEAVES) {
+			((SharedChain*)child)->refs.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	/*Drops one reference to node, which sits at depth, and frees whatever only it kept alive.*/
+	template <size_t keySize, size_t childCount>
+	void releaseShared(SharedBitNode<keySize, childCount>* node, size_t depth, LeafKind kind) {
+		if (node->refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+			return;
+		}
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = node->children[i];
+			if (child == nullptr) {
+				continue;
+			}
+			if (depth < BitNode<keySize, childCount>::bridgesSize) {
+				releaseShared((SharedBitNode<keySize, childCount>*)child, depth + 1, kind);
+			} else if (kind == CHAIN_LEAVES) {
+				SharedChain::release((SharedChain*)child);
+			}
+		}
+		delete node;
+	}
+
+	/*Returns the node at slot, which sits at depth, made private to the writer. A node that a
+	  version still shares is cloned, the clone takes a reference on every child and the slot
+	  drops its reference on the original, so only the root-to-leaf path of a write is copied.*/
+	template <size_t keySize, size_t childCount>
+	SharedBitNode<keySize, childCount>* ownShared(void** slot, size_t depth, LeafKind kind) {
+		SharedBitNode<keySize, childCount>* node = (SharedBitNode<keySize, childCount>*)*slot;
+		if (node == nullptr) {
+			node = new SharedBitNode<keySize, childCount>();
+			*slot = node;
+			return node;
+		}
+		if (node->refs.load(std::memory_order_acquire) == 1) {
+			return node;
+		}
+		SharedBitNode<keySize, childCount>* copy = new SharedBitNode<keySize, childCount>();
+		for (size_t i = 0; i < childCount; ++i)
+		{
+			void* child = node->children[i];
+			copy->children[i] = child;
+			if (child != nullptr) {
+				retainShared<keySize, childCount>(child, depth + 1, kind);
+			}
+		}
+		*slot = copy;
+		releaseShared(node, depth, kind);
+		return copy;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertShared(void** root, size_t key, void* data) {
+		SharedBitNode<keySize, childCount>* current = ownShared<keySize, childCount>(root, 0, VALUE_LEAVES);
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
 		{
 			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			if (current->children[shifted] == nullptr) {
+			current = ownShared<keySize, childCount>(&current->children[shifted], i + 1, VALUE_LEAVES);
+		}
+		current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift] = data;
+	}
+
+	template <size_t keySize, size_t childCount>
+	void insertSharedHash(void** root, size_t key, KeyValuePair* kvp) {
+		SharedBitNode<keySize, childCount>* current = ownShared<keySize, childCount>(root, 0, CHAIN_LEAVES);
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
+			current = ownShared<keySize, childCount>(&current->children[shifted], i + 1, CHAIN_LEAVES);
+		}
+		void** slot = &current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+		SharedChain* old = (SharedChain*)*slot;
+		// pairs are swapped rather than their values overwritten, versions keep what they saw
+		*slot = SharedChain::make(old, kvp);
+		if (old != nullptr) {
+			SharedChain::release(old);
+		}
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findShared(const SharedBitNode<keySize, childCount>* tree, size_t key) {
+		const SharedBitNode<keySize, childCount>* current = tree;
+		size_t i = 0;
+		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
+		{
+			current = (const SharedBitNode<keySize, childCount>*)current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+			if (current == nullptr) {
+				return nullptr;
+			}
+		}
+		return current->children[(key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift];
+	}
+
+	template <size_t keySize, size_t childCount>
+	void* findSharedHash(const SharedBitNode<keySize, childCount>* tree, size_t key, const KeyValuePair* kvp) {
+		const SharedChain* chain = (const SharedChain*)findShared(tree, key);
+		if (chain == nullptr) {
+			return nullptr;
+		}
+		for (size_t i = 0; i < chain->count; ++i)
+		{
+			if (std::memcmp(chain->kvps[i]->key, kvp->key, sizeof(kvp->key)) == 0) {
+				return chain->kvps[i]->value;
+			}
+		}
+		return nullptr;
+	}
+
+	/*Handle on one version of a copy-on-write tree. The version never changes, reading it takes
+	  no lock, and its nodes are freed once the last handle and the live tree let go of them.*/
+	template <size_t keySize, size_t childCount, LeafKind kind>
+	struct SharedVersion {
+		SharedBitNode<keySize, childCount>* _root = nullptr;
+
+		SharedVersion() {}
+
+		explicit SharedVersion(SharedBitNode<keySize, childCount>* root) : _root(root) {}
+
+		SharedVersion(const SharedVersion& other) : _root(other._root) {
+			if (_root != nullptr) {
+				_root->refs.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		SharedVersion(SharedVersion&& other) : _root(other._root) {
+			other._root = nullptr;
+		}
+
+		SharedVersion& operator=(SharedVersion other) {
+			std::swap(_root, other._root);
+			return *this;
+		}
+
+		~SharedVersion() {
+			if (_root != nullptr) {
+				releaseShared(_root, 0, kind);
+			}
+		}
+	};
+
+	template <size_t keySize, size_t childCount>
+	struct SharedIndexVersion : SharedVersion<keySize, childCount, VALUE_LEAVES> {
+		using SharedVersion<keySize, childCount, VALUE_LEAVES>::SharedVersion;
+
+		void* find(size_t key) const {
+			return findShared(this->_root, key);
+		}
+	};
+
+	template <size_t keySize, size_t childCount>
+	struct SharedMapVersion : SharedVersion<keySize, childCount, CHAIN_LEAVES> {
+		using SharedVersion<keySize, childCount, CHAIN_LEAVES>::SharedVersion;
+
+		void* find(const KeyValuePair* kvp) const {
+			size_t hash_key = hashData((void*)kvp->key, sizeof(kvp->key));
+			return findSharedHash(this->_root, hash_key, kvp);
+		}
+	};
+
+	/*How a BasicMapObj is built, set the fields that differ from the defaults.*/
+	struct MapOptions {
+		// partition node levels below the root, 0 takes the map's levels parameter
+		size_t partitionLevels = 0;
+		// contention a partition builds up before it splits
+		uint32_t splitThreshold = defaultSplitThreshold;
+		// inserts go through flat combining, for write heavy, skewed keys
+		bool combineWrites = false;
+		// chain length that splits a chain on more hash bits, 0 never splits
+		size_t chainLimit = defaultChainLimit;
+		// finds check a per-thread cache of recent lookups first
+		bool frontCache = false;
+	};
+
+	/*Partitioned hashed map. The geometry can be changed, keySize hash bits are consumed
+	  log2(childCount) bits per level and the top levels are shared, lock free, partitions.
+	  levels is only the default, the partition depth and split threshold are picked at
+	  construction through MapOptions and partitions are made as keys reach them.*/
+	template <class Alloc = SlabAllocator, size_t keySize = 25, size_t childCount = 32, size_t levels = 3, class Lock = MutexLock>
+	struct BasicMapObj {
+		static constexpr size_t mapKeySize = keySize;
+		static constexpr size_t mapChildCount = childCount;
+		static constexpr size_t levelCount = levels;
+		// room for at least one partition level above the leaves
+		static_assert(BitNode<mapKeySize, mapChildCount>::bridgesSize > 1);
+		Alloc _alloc;
+		PartitionTable<Alloc, Lock> _parts;
+		BitNode<mapKeySize, mapChildCount> _bnode;
+		// bulkLoad relies on every top level child owning its own partitions, so never 0
+		size_t _levels;
+		// inserts go through insertHashCombined, which pays off when a few partitions take most writes
+		bool _combine;
+		// chains that reach this length split on more hash bits, so lookups stay bounded as the map grows
+		size_t _chainLimit;
+		// finds go through the thread's FrontCache under this owner, 0 when they do not
+		uint64_t _cacheOwner;
+
+		explicit BasicMapObj(const MapOptions& options = MapOptions()) :
+			_levels(clampPartitionLevels<mapKeySize, mapChildCount>(options.partitionLevels == 0 ? levelCount : options.partitionLevels)),
+			_combine(options.combineWrites), _chainLimit(options.chainLimit),
+			_cacheOwner(options.frontCache ? FrontCache::newOwner() : 0) {
+			makeParitions<mapKeySize, mapChildCount>(&_bnode, _alloc, _parts, options.splitThreshold, CHAIN_LEAVES);
+		}
+
+		BasicMapObj(const BasicMapObj&) = delete;
+		BasicMapObj& operator=(const BasicMapObj&) = delete;
+
+		~BasicMapObj() {
+			freeParitions<mapKeySize, mapChildCount>(&_bnode, _levels, 0, CHAIN_LEAVES, _alloc, _parts);
+		}
+
+		void insert(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			//printf("got the hash %zu, bit cover %zu\n", hash_key & BIT_COVERS.shifts[mapKeySize], BIT_COVERS.shifts[mapKeySize]);
+			//for (int i = 0; i < 16; ++i)
+			//{
+			//	printf("%u ", kvp->key[i]);
+			//}
+			//printf("\n");
+			if (_combine) {
+				insertHashCombined<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, hash_key, kvp, _levels, _chainLimit);
+				return;
+			}
+			insertHashPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, hash_key, kvp, _levels, _chainLimit);
+		}
+
+		void* find(KeyValuePair* kvp) {
+			if (_cacheOwner != 0) {
+				return findHashCached<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, kvp, _levels, _cacheOwner);
+			}
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			return findHashPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, hash_key, kvp, _levels);
+		}
+
+		/*Removes the pair with the key of kvp and returns its value. Nodes left empty are pruned
+		  and go back to the partition allocator for later inserts.*/
+		void* remove(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			return removeHashPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, hash_key, kvp, _levels);
+		}
+
+		/*Calls callback(kvp) for every pair from up to threads threads at once, in no particular
+		  order. The partition locks are not taken, the map must not change meanwhile.*/
+		template <class Callback>
+		void forEach(Callback callback, size_t threads = std::thread::hardware_concurrency()) {
+			parallelWalk(&_bnode, threads, [&](size_t, size_t hash_key, void* leaf) { ChainLeafEntries<mapKeySize, mapChildCount>()(hash_key, leaf, callback); });
+		}
+
+		/*Combines map(kvp) over every pair, see parallelReduce.*/
+		template <class T, class Map, class Combine>
+		T reduce(T init, Map map, Combine combine, size_t threads = std::thread::hardware_concurrency()) {
+			return parallelReduce(&_bnode, threads, init, ChainLeafEntries<mapKeySize, mapChildCount>(), map, combine);
+		}
+
+		void findBatch(KeyValuePair* const* kvps, void** out, size_t count) {
+			size_t hashes[batchGroup];
+			for (size_t base = 0; base < count; base += batchGroup) {
+				size_t n = count - base < batchGroup ? count - base : batchGroup;
+				for (size_t j = 0; j < n; ++j)
+				{
+					hashes[j] = hashData(kvps[base + j]->key, sizeof(kvps[base + j]->key));
+				}
+				findHashBatchPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, hashes, kvps + base, out + base, n, _levels);
+			}
+		}
+
+		/*Inserts count pairs using up to threads builder threads. Not safe against concurrent use
+		  of the map, it is meant for filling a map at start up.*/
+		void bulkLoad(KeyValuePair* const* kvps, size_t count, size_t threads = std::thread::hardware_concurrency()) {
+			std::vector<size_t> hashes(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				hashes[i] = hashData(kvps[i]->key, sizeof(kvps[i]->key));
+			}
+			bulkBuild<mapKeySize, mapChildCount>(hashes.data(), count, threads, [&](size_t, const size_t* first, const size_t* last) {
+				for (; first != last; ++first) {
+					size_t hash_key = hashes[*first];
+					BitNode<mapKeySize, mapChildCount>* current = partitionNode<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, hash_key, _levels, true);
+					size_t i = _levels;
+					// every partition below a top level child belongs to this builder
+					PartitionState<Alloc, Lock>* state = (PartitionState<Alloc, Lock>*)current->lock;
+					while (state->split.load(std::memory_order_acquire)) {
+						current = (BitNode<mapKeySize, mapChildCount>*)current->children[(hash_key >> BitNode<mapKeySize, mapChildCount>::offsets.offsets[i]) & BitNode<mapKeySize, mapChildCount>::bitShift];
+						state = (PartitionState<Alloc, Lock>*)current->lock;
+						i += 1;
+					}
+					insertHashAt(current, i, hash_key, kvps[*first], state->alloc, _chainLimit);
+					state->bumpVersion();
+				}
+			});
+		}
+
+		bool saveSnapshot(const char* path) {
+			return FNTree::saveSnapshot<mapKeySize, mapChildCount>(&_bnode, path, CHAIN_LEAVES);
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			statParitions<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, _levels, 0, CHAIN_LEAVES, report);
+			return report;
+		}
+
+		/*Relays every partition out contiguously, one partition at a time, so it can run on a
+		  background thread while the map is in use.*/
+		CompactReport compact() {
+			CompactReport report;
+			compactParitions<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, _levels, 0, CHAIN_LEAVES, report);
+			return report;
+		}
+
+		/*Only for slab allocators, see HugePageAllocator.*/
+		HugePageReport hugePages() {
+			return partitionHugePages(_parts);
+		}
+	};
+
+	typedef BasicMapObj<> MapObj;
+
+	/*MapObj for arbitrary length keys, such as strings or byte spans. Keys are copied into the
+	  tree and hashed with hashBytes.*/
+	template <class Alloc = SlabAllocator>
+	struct BasicStrMapObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		static constexpr size_t levelCount = 3;
+		Alloc _alloc;
+		PartitionTable<Alloc> _parts;
+		BitNode<mapKeySize, mapChildCount> _bnode;
+
+		explicit BasicStrMapObj(uint32_t splitThreshold = defaultSplitThreshold) {
+			makeParitions<mapKeySize, mapChildCount>(&_bnode, _alloc, _parts, splitThreshold, BLOB_LEAVES);
+		}
+
+		BasicStrMapObj(const BasicStrMapObj&) = delete;
+		BasicStrMapObj& operator=(const BasicStrMapObj&) = delete;
+
+		~BasicStrMapObj() {
+			freeParitions<mapKeySize, mapChildCount>(&_bnode, levelCount, 0, BLOB_LEAVES, _alloc, _parts);
+		}
+
+		void insert(const void* key, size_t len, void* value) {
+			size_t hash_key = (size_t)hashBytes(key, len);
+			insertBlobPart<mapKeySize, mapChildCount, Alloc>(&_bnode, hash_key, key, len, value, levelCount);
+		}
+
+		void insert(std::string_view key, void* value) {
+			insert(key.data(), key.size(), value);
+		}
+
+		void* find(const void* key, size_t len) {
+			size_t hash_key = (size_t)hashBytes(key, len);
+			return findBlobPart<mapKeySize, mapChildCount, Alloc>(&_bnode, hash_key, key, len, levelCount);
+		}
+
+		void* find(std::string_view key) {
+			return find(key.data(), key.size());
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			statParitions<mapKeySize, mapChildCount, Alloc>(&_bnode, levelCount, 0, BLOB_LEAVES, report);
+			return report;
+		}
+	};
+
+	typedef BasicStrMapObj<> StrMapObj;
+
+	/*MapObj with inline LeafBuckets at the bottom. Keys and values are copied into the tree on
+	  insert, so a hit never leaves the bucket.*/
+	template <class Alloc = SlabAllocator>
+	struct BasicBucketMapObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		static constexpr size_t levelCount = 3;
+		static_assert(levelCount < BitNode<mapKeySize, mapChildCount>::bridgesSize);
+		Alloc _alloc;
+		PartitionTable<Alloc> _parts;
+		BitNode<mapKeySize, mapChildCount> _bnode;
+
+		explicit BasicBucketMapObj(uint32_t splitThreshold = defaultSplitThreshold) {
+			makeParitions<mapKeySize, mapChildCount>(&_bnode, _alloc, _parts, splitThreshold, BUCKET_LEAVES);
+		}
+
+		BasicBucketMapObj(const BasicBucketMapObj&) = delete;
+		BasicBucketMapObj& operator=(const BasicBucketMapObj&) = delete;
+
+		~BasicBucketMapObj() {
+			freeParitions<mapKeySize, mapChildCount>(&_bnode, levelCount, 0, BUCKET_LEAVES, _alloc, _parts);
+		}
+
+		void insert(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			insertBucketPart<mapKeySize, mapChildCount, Alloc>(&_bnode, hash_key, kvp, levelCount);
+		}
+
+		void* find(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			return findBucketPart<mapKeySize, mapChildCount, Alloc>(&_bnode, hash_key, kvp, levelCount);
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			statParitions<mapKeySize, mapChildCount, Alloc>(&_bnode, levelCount, 0, BUCKET_LEAVES, report);
+			return report;
+		}
+	};
+
+	typedef BasicBucketMapObj<> BucketMapObj;
+
+	/*Used for integer based keys , ideally as an index.*/
+	template <class Alloc = SlabAllocator>
+	struct BasicIndexObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		Alloc _alloc;
+		BitNode<mapKeySize, mapChildCount> _bnode;
+		TreeCounters _counters;
+
+		BasicIndexObj() {}
+		BasicIndexObj(const BasicIndexObj&) = delete;
+		BasicIndexObj& operator=(const BasicIndexObj&) = delete;
+
+		~BasicIndexObj() {
+			if (!Alloc::ownsMemory) {
+				freeSubtree<mapKeySize, mapChildCount>(&_bnode, 0, VALUE_LEAVES, _alloc);
+			}
+		}
+
+		void insert(size_t key, void* data) {
+			insertInto<mapKeySize, mapChildCount>(&_bnode, key, data, _alloc);
+		}
+
+		void* find(size_t key) {
+			void* found = findInto<mapKeySize, mapChildCount>(&_bnode, key);
+			_counters.recordFind(found);
+			return found;
+		}
+
+		/*Removes key and returns its value, pruning the nodes it leaves empty.*/
+		void* remove(size_t key) {
+			return removeInto<mapKeySize, mapChildCount>(&_bnode, key, _alloc);
+		}
+
+		/*Calls callback(key, value) for every entry from up to threads threads at once, in no
+		  particular order. The index must not change meanwhile.*/
+		template <class Callback>
+		void forEach(Callback callback, size_t threads = std::thread::hardware_concurrency()) {
+			parallelWalk(&_bnode, threads, [&](size_t, size_t key, void* value) { callback(key, value); });
+		}
+
+		/*Combines map(key, value) over every entry, see parallelReduce.*/
+		template <class T, class Map, class Combine>
+		T reduce(T init, Map map, Combine combine, size_t threads = std::thread::hardware_concurrency()) {
+			return parallelReduce(&_bnode, threads, init, ValueLeafEntries(), map, combine);
+		}
+
+		void findBatch(const size_t* keys, void** out, size_t count) {
+			FNTree::findBatch<mapKeySize, mapChildCount>(&_bnode, keys, out, count);
+		#if FNTREE_STATS
+			size_t hits = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				hits += out[i] != nullptr;
+			}
+			_counters.hits.add(hits);
+			_counters.misses.add(count - hits);
+		#endif
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			statSubtree(&_bnode, 0, VALUE_LEAVES, report.total);
+			_counters.fill(report.total);
+			return report;
+		}
+
+		/*Rebuilds the index into one contiguous region, see compactSubtree. Iterators and
+		  pointers into the old nodes are invalidated.*/
+		CompactReport compact() {
+			return compactSubtree(&_bnode, 0, VALUE_LEAVES, _alloc);
+		}
+
+		/*Only for slab allocators, see HugePageAllocator.*/
+		HugePageReport hugePages() {
+			return _alloc.hugePages();
+		}
+
+		typedef TreeIterator<mapKeySize, mapChildCount> iterator;
+		typedef TreeIterator<mapKeySize, mapChildCount, true> reverse_iterator;
+
+		iterator begin() {
+			iterator it;
+			it._cursor.first(&_bnode);
+			return it;
+		}
+
+		iterator end() {
+			return iterator();
+		}
+
+		reverse_iterator rbegin() {
+			reverse_iterator it;
+			it._cursor.last(&_bnode);
+			return it;
+		}
+
+		reverse_iterator rend() {
+			return reverse_iterator();
+		}
+
+		iterator lowerBound(size_t key) {
+			iterator it;
+			it._cursor.lowerBound(&_bnode, key);
+			return it;
+		}
+
+		template <class Callback>
+		void scan(size_t lo, size_t hi, Callback callback) {
+			scanInto<mapKeySize, mapChildCount>(&_bnode, lo, hi, callback);
+		}
+
+		/*Visits every key whose top prefixBits bits equal prefix. prefixBits past mapKeySize
+		  count as mapKeySize, the prefix is then the whole key.*/
+		template <class Callback>
+		void prefixScan(size_t prefix, size_t prefixBits, Callback callback) {
+			size_t rest = mapKeySize - (prefixBits < mapKeySize ? prefixBits : mapKeySize);
+			size_t lo = prefix << rest;
+			scanInto<mapKeySize, mapChildCount>(&_bnode, lo, lo | (((size_t)1 << rest) - 1), callback);
+		}
+
+		bool saveSnapshot(const char* path) {
+			return FNTree::saveSnapshot<mapKeySize, mapChildCount>(&_bnode, path, VALUE_LEAVES);
+		}
+
+		/*Inserts count pairs using up to threads builder threads, each filling its own arena
+		  that the index takes over once they are done.*/
+		void bulkLoad(const size_t* keys, void* const* values, size_t count, size_t threads = std::thread::hardware_concurrency()) {
+			std::vector<Alloc> arenas(threads == 0 ? 1 : threads);
+			bulkBuild<mapKeySize, mapChildCount>(keys, count, threads, [&](size_t t, const size_t* first, const size_t* last) {
+				for (; first != last; ++first) {
+					insertInto<mapKeySize, mapChildCount>(&_bnode, keys[*first], values[*first], arenas[t]);
+				}
+			});
+			for (size_t t = 0; t < arenas.size(); ++t)
+			{
+				_alloc.absorb(arenas[t]);
+			}
+		}
+
+	};
+
+	typedef BasicIndexObj<> IndexObj;
+
+	/*IndexObj snapshot opened for reading.*/
+	struct IndexSnapshot : SnapshotView<IndexObj::mapKeySize, IndexObj::mapChildCount> {
+		bool open(const char* path) {
+			return openView(path, VALUE_LEAVES);
+		}
+
+		void* find(size_t key) const {
+			return (void*)(uintptr_t)leafRef(key);
+		}
+	};
+
+	/*MapObj snapshot opened for reading, keys are compared against the pairs stored in the image.*/
+	struct MapSnapshot : SnapshotView<MapObj::mapKeySize, MapObj::mapChildCount> {
+		bool open(const char* path) {
+			return openView(path, CHAIN_LEAVES);
+		}
+
+		void* find(const KeyValuePair* kvp) const {
+			size_t hash_key = hashData((void*)kvp->key, sizeof(kvp->key));
+			uint64_t ref = leafRef(hash_key);
+			if (ref == 0) {
 				return nullptr;
 			}
-			current = (BitNode<keySize, childCount>*)current->children[shifted];
+			uint64_t count = *(const uint64_t*)(_base + ref);
+			const SnapshotPair* pairs = (const SnapshotPair*)(_base + ref + sizeof(count));
+			for (uint64_t i = 0; i < count; ++i)
+			{
+				if (std::memcmp(pairs[i].key, kvp->key, sizeof(kvp->key)) == 0) {
+					return (void*)(uintptr_t)pairs[i].value;
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	/*Integer index over the full key width. The top rootBits of a key select a slot in a flat,
+	  direct-mapped table, so lookups skip the upper levels, and the rest of the key is resolved by
+	  64-way CompactBitNodes. Each extra level costs one popcount and only the bytes of the children
+	  that exist, which keeps sparse 64-bit keys affordable.*/
+	template <size_t keyBits = 64, size_t rootBits = 16, size_t childCount = 64, class Alloc = SlabAllocator>
+	struct BasicWideIndexObj {
+		static_assert(keyBits <= sizeof(size_t) * CHAR_BIT);
+		static_assert(rootBits < keyBits && rootBits <= 24);
+		static constexpr size_t subKeySize = keyBits - rootBits;
+		static constexpr size_t rootCount = (size_t)1 << rootBits;
+		Alloc _alloc;
+		CompactBitNode<subKeySize, childCount>** _roots;
+		TreeCounters _counters;
+
+		BasicWideIndexObj() {
+			_roots = (CompactBitNode<subKeySize, childCount>**)std::calloc(rootCount, sizeof(void*));
+		}
+
+		BasicWideIndexObj(const BasicWideIndexObj&) = delete;
+		BasicWideIndexObj& operator=(const BasicWideIndexObj&) = delete;
+
+		~BasicWideIndexObj() {
+			for (size_t i = 0; i < rootCount; ++i)
+			{
+				if (_roots[i] != nullptr) {
+					freeCompactSubtree<subKeySize, childCount>(_roots[i], 0, VALUE_LEAVES, _alloc);
+					CompactBitNode<subKeySize, childCount>::drop(_roots[i], _alloc);
+				}
+			}
+			std::free(_roots);
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		KeyValueSpot* gotkv = (KeyValueSpot*)current->children[shiftedLast];
-		while (gotkv != nullptr) {
-			if (std::memcmp(gotkv->kvp->key, kvp->key, sizeof(kvp->key)) == 0) {
-				return gotkv->kvp->value;
+
+		static size_t rootIndex(size_t key) {
+			return (key >> subKeySize) & (rootCount - 1);
+		}
+
+		void insert(size_t key, void* data) {
+			CompactBitNode<subKeySize, childCount>** root = &_roots[rootIndex(key)];
+			if (*root == nullptr) {
+				*root = CompactBitNode<subKeySize, childCount>::make(1, _alloc);
 			}
-			gotkv = gotkv->next;
+			insertInto<subKeySize, childCount>(root, key, data, _alloc);
 		}
-		return nullptr;
-	}
 
-	template <size_t keySize, size_t childCount>
-	void* removeInto(BitNode<keySize, childCount>* tree, size_t key) {
-		BitNode<keySize, childCount>* current = tree;
-		size_t i = 0;
-		for (; i < BitNode<keySize, childCount>::bridgesSize; ++i)
-		{
-			size_t shifted = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-			if (current->children[shifted] == nullptr) {
-				return nullptr;
-			} 
-			current = (BitNode<keySize, childCount>*)current->children[shifted];
+		void* find(size_t key) {
+			CompactBitNode<subKeySize, childCount>* root = _roots[rootIndex(key)];
+			void* found = root == nullptr ? nullptr : findInto<subKeySize, childCount>(root, key);
+			_counters.recordFind(found);
+			return found;
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			report.total.nodeBytes += rootCount * sizeof(void*);
+			for (size_t i = 0; i < rootCount; ++i)
+			{
+				if (_roots[i] != nullptr) {
+					statCompactSubtree<subKeySize, childCount>(_roots[i], 0, VALUE_LEAVES, report.total);
+				}
+			}
+			_counters.fill(report.total);
+			return report;
 		}
-		size_t shiftedLast = (key >> BitNode<keySize, childCount>::offsets.offsets[i]) & BitNode<keySize, childCount>::bitShift;
-		void* got = current->children[shiftedLast];
-		current->children[shiftedLast] = nullptr;
-		return got;
-	}
 
-	struct MapObj {
+	};
+
+	typedef BasicWideIndexObj<> WideIndexObj;
+
+	/*IndexObj built from CompactBitNodes, several times smaller when the key space is sparse.*/
+	template <class Alloc = SlabAllocator>
+	struct BasicCompactIndexObj {
 		static constexpr size_t mapKeySize = 25;
 		static constexpr size_t mapChildCount = 32;
-		static constexpr size_t levelCount = 3;
-		BitNode<mapKeySize, mapChildCount> _bnode;
+		Alloc _alloc;
+		CompactBitNode<mapKeySize, mapChildCount>* _root;
+		TreeCounters _counters;
+
+		BasicCompactIndexObj() {
+			_root = CompactBitNode<mapKeySize, mapChildCount>::make(mapChildCount, _alloc);
+		}
+
+		BasicCompactIndexObj(const BasicCompactIndexObj&) = delete;
+		BasicCompactIndexObj& operator=(const BasicCompactIndexObj&) = delete;
+
+		~BasicCompactIndexObj() {
+			freeCompactSubtree<mapKeySize, mapChildCount>(_root, 0, VALUE_LEAVES, _alloc);
+			CompactBitNode<mapKeySize, mapChildCount>::drop(_root, _alloc);
+		}
+
+		void insert(size_t key, void* data) {
+			insertInto<mapKeySize, mapChildCount>(&_root, key, data, _alloc);
+		}
+
+		void* find(size_t key) {
+			void* found = findInto<mapKeySize, mapChildCount>(_root, key);
+			_counters.recordFind(found);
+			return found;
+		}
 
-		MapObj() {
-			makeParitions<mapKeySize, mapChildCount>(&_bnode, levelCount);
+		StatsReport stats() {
+			StatsReport report;
+			statCompactSubtree<mapKeySize, mapChildCount>(_root, 0, VALUE_LEAVES, report.total);
+			_counters.fill(report.total);
+			return report;
+		}
+	};
+
+	typedef BasicCompactIndexObj<> CompactIndexObj;
+
+	/*Single-threaded hashed map built from CompactBitNodes.*/
+	template <class Alloc = SlabAllocator>
+	struct BasicCompactMapObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		Alloc _alloc;
+		CompactBitNode<mapKeySize, mapChildCount>* _root;
+		TreeCounters _counters;
+
+		BasicCompactMapObj() {
+			_root = CompactBitNode<mapKeySize, mapChildCount>::make(mapChildCount, _alloc);
+		}
+
+		BasicCompactMapObj(const BasicCompactMapObj&) = delete;
+		BasicCompactMapObj& operator=(const BasicCompactMapObj&) = delete;
+
+		~BasicCompactMapObj() {
+			freeCompactSubtree<mapKeySize, mapChildCount>(_root, 0, CHAIN_LEAVES, _alloc);
+			CompactBitNode<mapKeySize, mapChildCount>::drop(_root, _alloc);
 		}
 
 		void insert(KeyValuePair* kvp) {
 			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
-			//printf("got the hash %zu, bit cover %zu\n", hash_key & BIT_COVERS.shifts[mapKeySize], BIT_COVERS.shifts[mapKeySize]);
-			//for (int i = 0; i < 16; ++i)
-			//{
-			//	printf("%u ", kvp->key[i]);
-			//}
-			//printf("\n");
-			insertHashPart<mapKeySize, mapChildCount>(&_bnode, hash_key, kvp, levelCount);
+			insertHash<mapKeySize, mapChildCount>(&_root, hash_key, kvp, _alloc);
 		}
 
 		void* find(KeyValuePair* kvp) {
 			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
-			return findHashPart<mapKeySize, mapChildCount>(&_bnode, hash_key, kvp, levelCount);
+			void* found = findHash<mapKeySize, mapChildCount>(_root, hash_key, kvp);
+			_counters.recordFind(found);
+			return found;
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			statCompactSubtree<mapKeySize, mapChildCount>(_root, 0, CHAIN_LEAVES, report.total);
+			_counters.fill(report.total);
+			return report;
 		}
 	};
 
-	/*Used for integer based keys , ideally as an index.*/
-	struct IndexObj {
+	typedef BasicCompactMapObj<> CompactMapObj;
+
+	/*IndexObj built from SlimBitNodes, a 32 way inner node takes 128 bytes instead of 264.*/
+	struct SlimIndexObj {
 		static constexpr size_t mapKeySize = 25;
 		static constexpr size_t mapChildCount = 32;
-		BitNode<mapKeySize, mapChildCount> _bnode;
+		SlimStore<mapKeySize, mapChildCount> _store;
+		TreeCounters _counters;
 
 		void insert(size_t key, void* data) {
-			insertInto<mapKeySize, mapChildCount>(&_bnode, key, data);
+			insertInto<mapKeySize, mapChildCount>(_store, key, data);
 		}
 
 		void* find(size_t key) {
-			return findInto<mapKeySize, mapChildCount>(&_bnode, key);
+			void* found = findInto<mapKeySize, mapChildCount>(_store, key);
+			_counters.recordFind(found);
+			return found;
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			statSlimSubtree<mapKeySize, mapChildCount>(_store, 0, 0, VALUE_LEAVES, report.total);
+			_counters.fill(report.total);
+			return report;
+		}
+	};
+
+	/*Single-threaded hashed map built from SlimBitNodes.*/
+	struct SlimMapObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		SlimStore<mapKeySize, mapChildCount> _store;
+		TreeCounters _counters;
+
+		void insert(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			insertHash<mapKeySize, mapChildCount>(_store, hash_key, kvp);
+		}
+
+		void* find(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			void* found = findHash<mapKeySize, mapChildCount>(_store, hash_key, kvp);
+			_counters.recordFind(found);
+			return found;
 		}
 
+		StatsReport stats() {
+			StatsReport report;
+			statSlimSubtree<mapKeySize, mapChildCount>(_store, 0, 0, CHAIN_LEAVES, report.total);
+			_counters.fill(report.total);
+			return report;
+		}
 	};
 
-	/*Partitioned for multi-thread use*/
-	struct MTIndexObj {
+	/*Partitioned for multi-thread use, Lock is one of the partition lock policies.*/
+	template <class Alloc = SlabAllocator, class Lock = MutexLock>
+	struct BasicMTIndexObj {
 		static constexpr size_t mapKeySize = 25;
 		static constexpr size_t mapChildCount = 32;
 		static constexpr size_t levelCount = 3;
+		Alloc _alloc;
+		PartitionTable<Alloc, Lock> _parts;
 		BitNode<mapKeySize, mapChildCount> _bnode;
+		size_t _levels;
+
+		explicit BasicMTIndexObj(size_t partitionLevels = levelCount, uint32_t splitThreshold = defaultSplitThreshold) :
+			_levels(clampPartitionLevels<mapKeySize, mapChildCount>(partitionLevels)) {
+			makeParitions<mapKeySize, mapChildCount>(&_bnode, _alloc, _parts, splitThreshold, VALUE_LEAVES);
+		}
+
+		BasicMTIndexObj(const BasicMTIndexObj&) = delete;
+		BasicMTIndexObj& operator=(const BasicMTIndexObj&) = delete;
+
+		~BasicMTIndexObj() {
+			freeParitions<mapKeySize, mapChildCount>(&_bnode, _levels, 0, VALUE_LEAVES, _alloc, _parts);
+		}
+
+		void insert(size_t key, void* data) {
+			insertIntoPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, key, data, _levels);
+		}
+
+		void* find(size_t key) {
+			return findIntoPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, key, _levels);
+		}
+
+		void* remove(size_t key) {
+			return removeIntoPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, key, _levels);
+		}
+
+		/*Same as IndexObj::forEach, the partition locks are not taken.*/
+		template <class Callback>
+		void forEach(Callback callback, size_t threads = std::thread::hardware_concurrency()) {
+			parallelWalk(&_bnode, threads, [&](size_t, size_t key, void* value) { callback(key, value); });
+		}
+
+		template <class T, class Map, class Combine>
+		T reduce(T init, Map map, Combine combine, size_t threads = std::thread::hardware_concurrency()) {
+			return parallelReduce(&_bnode, threads, init, ValueLeafEntries(), map, combine);
+		}
+
+		void findBatch(const size_t* keys, void** out, size_t count) {
+			findBatchPart<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, keys, out, count, _levels);
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			statParitions<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, _levels, 0, VALUE_LEAVES, report);
+			return report;
+		}
+
+		/*Same as MapObj::compact.*/
+		CompactReport compact() {
+			CompactReport report;
+			compactParitions<mapKeySize, mapChildCount, Alloc, Lock>(&_bnode, _levels, 0, VALUE_LEAVES, report);
+			return report;
+		}
+
+		HugePageReport hugePages() {
+			return partitionHugePages(_parts);
+		}
+	};
+
+	typedef BasicMTIndexObj<> MTIndexObj;
+
+	/*IndexObj with typed values. Values that are trivially copyable and fit in a pointer live in
+	  the last level slot itself, and that node's lock word, unused outside partitioned trees,
+	  holds a bitmap of the slots in use, so a stored 0 is still found. Other values are boxed.*/
+	template <class V, class Alloc = SlabAllocator>
+	struct TypedIndexObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		static constexpr bool inlineValues = sizeof(V) <= sizeof(void*) && alignof(V) <= alignof(void*) && std::is_trivially_copyable<V>::value;
+		typedef BitNode<mapKeySize, mapChildCount> Node;
+		static_assert(mapChildCount <= sizeof(uintptr_t) * CHAR_BIT);
+		Alloc _alloc;
+		Node _bnode;
+
+		TypedIndexObj() {}
+		TypedIndexObj(const TypedIndexObj&) = delete;
+		TypedIndexObj& operator=(const TypedIndexObj&) = delete;
+
+		~TypedIndexObj() {
+			if constexpr (!inlineValues) {
+				dropBoxed(&_bnode, 0);
+			}
+			if (!Alloc::ownsMemory) {
+				freeSubtree<mapKeySize, mapChildCount>(&_bnode, 0, VALUE_LEAVES, _alloc);
+			}
+		}
+
+		static void dropBoxed(Node* tree, size_t depth) {
+			for (size_t i = 0; i < mapChildCount; ++i)
+			{
+				if (tree->children[i] == nullptr) {
+					continue;
+				}
+				if (depth < Node::bridgesSize) {
+					dropBoxed((Node*)tree->children[i], depth + 1);
+				} else {
+					delete (V*)tree->children[i];
+				}
+			}
+		}
+
+		static size_t lastSlot(size_t key) {
+			return (key >> Node::offsets.offsets[Node::bridgesSize]) & Node::bitShift;
+		}
+
+		static bool isUsed(const Node* node, size_t slot) {
+			return ((uintptr_t)node->lock & ((uintptr_t)1 << slot)) != 0;
+		}
+
+		Node* leaf(size_t key, bool create) {
+			Node* current = &_bnode;
+			for (size_t i = 0; i < Node::bridgesSize; ++i)
+			{
+				size_t shifted = (key >> Node::offsets.offsets[i]) & Node::bitShift;
+				if (current->children[shifted] == nullptr) {
+					if (!create) {
+						return nullptr;
+					}
+					current->children[shifted] = _alloc.template make<Node>();
+				}
+				current = (Node*)current->children[shifted];
+			}
+			return current;
+		}
+
+		void insert(size_t key, const V& value) {
+			Node* node = leaf(key, true);
+			size_t slot = lastSlot(key);
+			if constexpr (inlineValues) {
+				new (&node->children[slot]) V(value);
+			} else {
+				if (isUsed(node, slot)) {
+					*(V*)node->children[slot] = value;
+				} else {
+					node->children[slot] = new V(value);
+				}
+			}
+			node->lock = (void*)((uintptr_t)node->lock | ((uintptr_t)1 << slot));
+		}
+
+		/*The stored value, valid until the key is inserted again.*/
+		V* findRef(size_t key) {
+			Node* node = leaf(key, false);
+			size_t slot = lastSlot(key);
+			if (node == nullptr || !isUsed(node, slot)) {
+				return nullptr;
+			}
+			if constexpr (inlineValues) {
+				return std::launder(reinterpret_cast<V*>(&node->children[slot]));
+			} else {
+				return (V*)node->children[slot];
+			}
+		}
+
+		bool find(size_t key, V& out) {
+			V* got = findRef(key);
+			if (got == nullptr) {
+				return false;
+			}
+			out = *got;
+			return true;
+		}
+	};
+
+	/*Leaf entry of a TypedMapObj, the value sits next to its key.*/
+	template <class K, class V>
+	struct TypedSpot {
+		K key;
+		V value;
+		TypedSpot* next;
+	};
+
+	/*MapObj with typed keys and values. Keys are hashed and compared by their bytes, so they must
+	  not carry padding, and values are copied into the leaf entry instead of being pointed to.*/
+	template <class K, class V, class Alloc = SlabAllocator>
+	struct TypedMapObj {
+		static_assert(std::is_trivially_copyable<K>::value && std::has_unique_object_representations<K>::value);
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		static constexpr size_t levelCount = 3;
+		typedef BitNode<mapKeySize, mapChildCount> Node;
+		typedef TypedSpot<K, V> Spot;
+		Alloc _alloc;
+		PartitionTable<Alloc> _parts;
+		Node _bnode;
+
+		explicit TypedMapObj(uint32_t splitThreshold = defaultSplitThreshold) {
+			makeParitions<mapKeySize, mapChildCount>(&_bnode, _alloc, _parts, splitThreshold, VALUE_LEAVES);
+		}
+
+		TypedMapObj(const TypedMapObj&) = delete;
+		TypedMapObj& operator=(const TypedMapObj&) = delete;
+
+		~TypedMapObj() {
+			dropSpots(&_bnode, levelCount, 0);
+			// the leaf slots are empty now, only nodes are left
+			freeParitions<mapKeySize, mapChildCount>(&_bnode, levelCount, 0, VALUE_LEAVES, _alloc, _parts);
+		}
+
+		static void dropSubtree(Node* tree, size_t depth, Alloc& alloc) {
+			for (size_t i = 0; i < mapChildCount; ++i)
+			{
+				if (tree->children[i] == nullptr) {
+					continue;
+				}
+				if (depth < Node::bridgesSize) {
+					dropSubtree((Node*)tree->children[i], depth + 1, alloc);
+					continue;
+				}
+				Spot* spot = (Spot*)tree->children[i];
+				while (spot != nullptr) {
+					Spot* next = spot->next;
+					spot->~Spot();
+					alloc.recycle(spot, sizeof(Spot), alignof(Spot));
+					spot = next;
+				}
+				tree->children[i] = nullptr;
+			}
+		}
+
+		static void dropSpots(Node* tree, size_t level, size_t depth) {
+			if (level == 0) {
+				PartitionState<Alloc>* state = (PartitionState<Alloc>*)tree->lock;
+				if (state->split.load(std::memory_order_relaxed)) {
+					for (size_t i = 0; i < mapChildCount; ++i)
+					{
+						dropSpots((Node*)tree->children[i], 0, depth + 1);
+					}
+				} else if (!Alloc::ownsMemory || !std::is_trivially_destructible<Spot>::value) {
+					dropSubtree(tree, depth, state->alloc);
+				}
+				return;
+			}
+			for (size_t i = 0; i < mapChildCount; ++i)
+			{
+				if (tree->children[i] != nullptr) {
+					dropSpots((Node*)tree->children[i], level - 1, depth + 1);
+				}
+			}
+		}
+
+		static size_t hashKey(const K& key) {
+			return (size_t)hashBytes(&key, sizeof(K));
+		}
+
+		void insert(const K& key, const V& value) {
+			size_t hash_key = hashKey(key);
+			Node* current = partitionNode<mapKeySize, mapChildCount, Alloc, MutexLock>(&_bnode, hash_key, levelCount, true);
+			size_t i = levelCount;
+			PartitionState<Alloc>* state = lockPartition<mapKeySize, mapChildCount, Alloc, MutexLock>(&_bnode, current, i, hash_key, false);
+			ScopedPartLock scoped(state, std::adopt_lock);
+			for (; i < Node::bridgesSize; ++i)
+			{
+				size_t shifted = (hash_key >> Node::offsets.offsets[i]) & Node::bitShift;
+				if (current->children[shifted] == nullptr) {
+					current->children[shifted] = state->alloc.template make<Node>();
+				}
+				current = (Node*)current->children[shifted];
+			}
+			void** slot = &current->children[(hash_key >> Node::offsets.offsets[i]) & Node::bitShift];
+			for (Spot* spot = (Spot*)*slot; spot != nullptr; spot = spot->next) {
+				if (std::memcmp(&spot->key, &key, sizeof(K)) == 0) {
+					spot->value = value;
+					return;
+				}
+			}
+			*slot = new (state->alloc.allocate(sizeof(Spot), alignof(Spot))) Spot{key, value, (Spot*)*slot};
+		}
+
+		/*Copies the value of key into out, false when the key is missing.*/
+		bool find(const K& key, V& out) {
+			size_t hash_key = hashKey(key);
+			Node* current = partitionNode<mapKeySize, mapChildCount, Alloc, MutexLock>(&_bnode, hash_key, levelCount, false);
+			if (current == nullptr) {
+				return false;
+			}
+			size_t i = levelCount;
+			PartitionState<Alloc>* state = lockPartition<mapKeySize, mapChildCount, Alloc, MutexLock>(&_bnode, current, i, hash_key, true);
+			ScopedPartReadLock scoped(state, std::adopt_lock);
+			Spot* spot = findSpot(current, i, hash_key, key);
+			state->counters.recordFind(spot);
+			if (spot == nullptr) {
+				return false;
+			}
+			out = spot->value;
+			return true;
+		}
+
+		/*The stored value without a copy. Entries never move, but reading through the pointer
+		  races with another thread inserting the same key.*/
+		V* findRef(const K& key) {
+			size_t hash_key = hashKey(key);
+			Node* current = partitionNode<mapKeySize, mapChildCount, Alloc, MutexLock>(&_bnode, hash_key, levelCount, false);
+			if (current == nullptr) {
+				return nullptr;
+			}
+			size_t i = levelCount;
+			PartitionState<Alloc>* state = lockPartition<mapKeySize, mapChildCount, Alloc, MutexLock>(&_bnode, current, i, hash_key, true);
+			ScopedPartReadLock scoped(state, std::adopt_lock);
+			Spot* spot = findSpot(current, i, hash_key, key);
+			state->counters.recordFind(spot);
+			return spot == nullptr ? nullptr : &spot->value;
+		}
+
+		Spot* findSpot(Node* current, size_t i, size_t hash_key, const K& key) {
+			for (; i < Node::bridgesSize; ++i)
+			{
+				current = (Node*)current->children[(hash_key >> Node::offsets.offsets[i]) & Node::bitShift];
+				if (current == nullptr) {
+					return nullptr;
+				}
+			}
+			for (Spot* spot = (Spot*)current->children[(hash_key >> Node::offsets.offsets[i]) & Node::bitShift]; spot != nullptr; spot = spot->next) {
+				if (std::memcmp(&spot->key, &key, sizeof(K)) == 0) {
+					return spot;
+				}
+			}
+			return nullptr;
+		}
+	};
+
+	/*Lock-free counterpart of MapObj, inserts publish with compare-and-swap and finds never lock.*/
+	struct LFMapObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		AtomicBitNode<mapKeySize, mapChildCount> _bnode;
+		TreeCounters _counters;
+
+		LFMapObj() {}
+		LFMapObj(const LFMapObj&) = delete;
+		LFMapObj& operator=(const LFMapObj&) = delete;
+
+		// must not race with any other access, retired nodes are already unlinked
+		~LFMapObj() {
+			freeAtomicSubtree<mapKeySize, mapChildCount>(&_bnode, 0, CHAIN_LEAVES);
+		}
+
+		void insert(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			EpochGuard guard;
+			insertHashAtomic<mapKeySize, mapChildCount>(&_bnode, hash_key, kvp);
+		}
+
+		void* find(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			EpochGuard guard;
+			void* found = findHashAtomic<mapKeySize, mapChildCount>(&_bnode, hash_key, kvp);
+			_counters.recordFind(found);
+			return found;
+		}
+
+		void* remove(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			EpochGuard guard;
+			return removeHashAtomic<mapKeySize, mapChildCount>(&_bnode, hash_key, kvp);
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			EpochGuard guard;
+			statAtomicSubtree<mapKeySize, mapChildCount>(&_bnode, 0, CHAIN_LEAVES, report.total);
+			_counters.fill(report.total);
+			return report;
+		}
+	};
+
+	/*Lock-free counterpart of MTIndexObj.*/
+	struct LFIndexObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		AtomicBitNode<mapKeySize, mapChildCount> _bnode;
+		TreeCounters _counters;
+
+		LFIndexObj() {}
+		LFIndexObj(const LFIndexObj&) = delete;
+		LFIndexObj& operator=(const LFIndexObj&) = delete;
+
+		~LFIndexObj() {
+			freeAtomicSubtree<mapKeySize, mapChildCount>(&_bnode, 0, VALUE_LEAVES);
+		}
 
-		MTIndexObj() {
-			makeParitions<mapKeySize, mapChildCount>(&_bnode, levelCount);
+		void insert(size_t key, void* data) {
+			EpochGuard guard;
+			insertIntoAtomic<mapKeySize, mapChildCount>(&_bnode, key, data);
+		}
+
+		void* find(size_t key) {
+			EpochGuard guard;
+			void* found = findIntoAtomic<mapKeySize, mapChildCount>(&_bnode, key);
+			_counters.recordFind(found);
+			return found;
+		}
+
+		void* remove(size_t key) {
+			EpochGuard guard;
+			return removeIntoAtomic<mapKeySize, mapChildCount>(&_bnode, key);
+		}
+
+		StatsReport stats() {
+			StatsReport report;
+			EpochGuard guard;
+			statAtomicSubtree<mapKeySize, mapChildCount>(&_bnode, 0, VALUE_LEAVES, report.total);
+			_counters.fill(report.total);
+			return report;
+		}
+	};
+	/*IndexObj with copy-on-write versions. Writers share one mutex and clone only the nodes a
+	  snapshot still sees, snapshot() is O(1) and hands out a version that readers walk without
+	  any locking while writers carry on.*/
+	struct VersionedIndexObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		typedef SharedIndexVersion<mapKeySize, mapChildCount> Version;
+		std::mutex _rootMux;
+		void* _root = new SharedBitNode<mapKeySize, mapChildCount>();
+
+		VersionedIndexObj() {}
+		VersionedIndexObj(const VersionedIndexObj&) = delete;
+		VersionedIndexObj& operator=(const VersionedIndexObj&) = delete;
+
+		// versions handed out stay valid, they hold their own references
+		~VersionedIndexObj() {
+			releaseShared((SharedBitNode<mapKeySize, mapChildCount>*)_root, 0, VALUE_LEAVES);
 		}
 
 		void insert(size_t key, void* data) {
-			insertIntoPart<mapKeySize, mapChildCount>(&_bnode, key, data, levelCount);
+			std::lock_guard<std::mutex> scoped(_rootMux);
+			insertShared<mapKeySize, mapChildCount>(&_root, key, data);
 		}
 
 		void* find(size_t key) {
-			return findIntoPart<mapKeySize, mapChildCount>(&_bnode, key, levelCount);
+			std::lock_guard<std::mutex> scoped(_rootMux);
+			return findShared((SharedBitNode<mapKeySize, mapChildCount>*)_root, key);
+		}
+
+		Version snapshot() {
+			std::lock_guard<std::mutex> scoped(_rootMux);
+			SharedBitNode<mapKeySize, mapChildCount>* root = (SharedBitNode<mapKeySize, mapChildCount>*)_root;
+			root->refs.fetch_add(1, std::memory_order_relaxed);
+			return Version(root);
+		}
+	};
+
+	/*MapObj with copy-on-write versions, see VersionedIndexObj.*/
+	struct VersionedMapObj {
+		static constexpr size_t mapKeySize = 25;
+		static constexpr size_t mapChildCount = 32;
+		typedef SharedMapVersion<mapKeySize, mapChildCount> Version;
+		std::mutex _rootMux;
+		void* _root = new SharedBitNode<mapKeySize, mapChildCount>();
+
+		VersionedMapObj() {}
+		VersionedMapObj(const VersionedMapObj&) = delete;
+		VersionedMapObj& operator=(const VersionedMapObj&) = delete;
+
+		~VersionedMapObj() {
+			releaseShared((SharedBitNode<mapKeySize, mapChildCount>*)_root, 0, CHAIN_LEAVES);
+		}
+
+		void insert(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			std::lock_guard<std::mutex> scoped(_rootMux);
+			insertSharedHash<mapKeySize, mapChildCount>(&_root, hash_key, kvp);
+		}
+
+		void* find(KeyValuePair* kvp) {
+			size_t hash_key = hashData(kvp->key, sizeof(kvp->key));
+			std::lock_guard<std::mutex> scoped(_rootMux);
+			return findSharedHash((SharedBitNode<mapKeySize, mapChildCount>*)_root, hash_key, kvp);
 		}
 
+		Version snapshot() {
+			std::lock_guard<std::mutex> scoped(_rootMux);
+			SharedBitNode<mapKeySize, mapChildCount>* root = (SharedBitNode<mapKeySize, mapChildCount>*)_root;
+			root->refs.fetch_add(1, std::memory_order_relaxed);
+			return Version(root);
+		}
 	};
 }
 
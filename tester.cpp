@@ -18,6 +18,7 @@
 #include <random>
 #include <thread>
 #include <atomic>
+#include <array>
 
 using namespace std::chrono;
 
@@ -53,7 +54,12 @@ static void populateStrBank() {
 }
 
 static FNTree::MapObj aNode;
+static FNTree::LFMapObj lfNode;
+static FNTree::BucketMapObj* bucketNode = nullptr;
+static FNTree::CompactMapObj* compactNode = nullptr;
+static FNTree::SlimMapObj* slimNode = nullptr;
 static std::unordered_map<std::string, void*> aMap;
+static FNTree::StrMapObj* strNode = nullptr;
 
 void tester_map_func(void) {
 	for (std::vector<std::string>::iterator i = STR_BANK.begin(); i != STR_BANK.end(); ++i)
@@ -73,6 +79,22 @@ void lookup_map_func(void) {
 	printf("adder %zu\n", adder);
 }
 
+void str_tester_func(void) {
+	for (std::vector<std::string>::iterator i = STR_BANK.begin(); i != STR_BANK.end(); ++i)
+	{
+		strNode->insert(*i, (void*)i->c_str());
+	}
+}
+
+void str_lookup_func(void) {
+	size_t adder = 0;
+	for (std::vector<std::string>::iterator i = STR_BANK.begin(); i != STR_BANK.end(); ++i)
+	{
+		void* found = strNode->find(*i);
+		adder += (size_t)found;
+	}
+	printf("adder %zu\n", adder);
+}
 
 void tester_func(void) {
 	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
@@ -98,11 +120,114 @@ void tester_func_spec(const std::vector<FNTree::KeyValuePair*>& numbers) {
 	}
 }
 
+void reduce_func(void) {
+	size_t adder = aNode.reduce((size_t)0, [](FNTree::KeyValuePair* kvp) { return (size_t)kvp->value; }, [](size_t a, size_t b) { return a + b; });
+	printf("adder %zu\n", adder);
+}
+
+void bulk_tester_func(void) {
+	FNTree::MapObj* bulkNode = new FNTree::MapObj();
+	bulkNode->bulkLoad(NUM_BANK.data(), NUM_BANK.size());
+	delete bulkNode;
+}
+
+void snapshot_save_func(void) {
+	if (!aNode.saveSnapshot("fnt-test.snap")) {
+		printf("snapshot save failed\n");
+	}
+}
+
+void snapshot_lookup_func(void) {
+	FNTree::MapSnapshot snapshot;
+	if (!snapshot.open("fnt-test.snap")) {
+		printf("snapshot open failed\n");
+		return;
+	}
+	size_t adder = 0;
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		adder += (size_t)snapshot.find(*i);
+	}
+	printf("adder %zu\n", adder);
+}
+
+void versioned_tester_func(void) {
+	FNTree::VersionedMapObj versioned;
+	size_t count = 0;
+	FNTree::VersionedMapObj::Version held;
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		versioned.insert(*i);
+		// a reader pinning a new version every so often forces path copies on the next inserts
+		if (++count % 1000 == 0) {
+			held = versioned.snapshot();
+		}
+	}
+	size_t adder = 0;
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		adder += (size_t)held.find(*i);
+	}
+	printf("adder %zu\n", adder);
+}
+
+typedef std::array<unsigned char, sizeof(FNTree::KeyValuePair::key)> TypedKey;
+static FNTree::TypedMapObj<TypedKey, int>* typedNode = nullptr;
+
+void typed_tester_func(void) {
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		TypedKey key;
+		std::memcpy(key.data(), (*i)->key, key.size());
+		typedNode->insert(key, *(int*)(*i)->value);
+	}
+}
+
+void typed_lookup_func(void) {
+	size_t adder = 0;
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		TypedKey key;
+		std::memcpy(key.data(), (*i)->key, key.size());
+		int found = 0;
+		typedNode->find(key, found);
+		adder += (size_t)found;
+	}
+	printf("adder %zu\n", adder);
+}
+
+void lf_tester_func(void) {
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		lfNode.insert(*i);
+	}
+}
+
+void bucket_tester_func(void) {
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		bucketNode->insert(*i);
+	}
+}
+
+void compact_tester_func(void) {
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		compactNode->insert(*i);
+	}
+}
+
+void slim_tester_func(void) {
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		slimNode->insert(*i);
+	}
+}
+
 void deleter_func(void) {
 	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
 	{
-		//size_t result = removeFull(&aNode, *i);
-		//printf("removed %zu nodes\n", result);
+		aNode.remove(*i);
 	}
 }
 
@@ -119,6 +244,52 @@ void lookup_func(void) {
 	printf("adder %zu\n", adder);
 }
 
+void batch_lookup_func(void) {
+	static constexpr size_t batchSize = 64;
+	void* found[batchSize];
+	size_t adder = 0;
+	for (size_t base = 0; base < NUM_BANK.size(); base += batchSize)
+	{
+		size_t n = std::min(batchSize, NUM_BANK.size() - base);
+		aNode.findBatch(&NUM_BANK[base], found, n);
+		for (size_t j = 0; j < n; ++j)
+		{
+			adder += (size_t)found[j];
+		}
+	}
+	printf("adder %zu\n", adder);
+}
+
+void bucket_lookup_func(void) {
+	size_t adder = 0;
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		void* found = bucketNode->find(*i);
+		adder += (size_t)found;
+	}
+	printf("adder %zu\n", adder);
+}
+
+void compact_lookup_func(void) {
+	size_t adder = 0;
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		void* found = compactNode->find(*i);
+		adder += (size_t)found;
+	}
+	printf("adder %zu\n", adder);
+}
+
+void slim_lookup_func(void) {
+	size_t adder = 0;
+	for (std::vector<FNTree::KeyValuePair*>::iterator i = NUM_BANK.begin(); i != NUM_BANK.end(); ++i)
+	{
+		void* found = slimNode->find(*i);
+		adder += (size_t)found;
+	}
+	printf("adder %zu\n", adder);
+}
+
 void lookup_func_spec(const std::vector<FNTree::KeyValuePair*>& numbers) {
 	size_t adder = 0;
 	for (auto i = numbers.begin(); i != numbers.end(); ++i)
@@ -132,6 +303,16 @@ void lookup_func_spec(const std::vector<FNTree::KeyValuePair*>& numbers) {
 	printf("adder %zu\n", adder);
 }
 
+void lf_lookup_func_spec(const std::vector<FNTree::KeyValuePair*>& numbers) {
+	size_t adder = 0;
+	for (auto i = numbers.begin(); i != numbers.end(); ++i)
+	{
+		void* found = lfNode.find(*i);
+		adder += (size_t)found;
+	}
+	printf("adder %zu\n", adder);
+}
+
 void time_function(const char* name, std::function<void(void)> func, unsigned times) {
 	auto start = high_resolution_clock::now();
 	for (unsigned i = 0; i < times; ++i)
@@ -140,13 +321,13 @@ void time_function(const char* name, std::function<void(void)> func, unsigned ti
 	}
 	auto stop = high_resolution_clock::now();
 	auto duration = duration_cast<microseconds>(stop - start);
-	std::printf("%s -> US %llu\n", name, duration.count());
+	std::printf("%s -> US %lld\n", name, (long long)duration.count());
 }
 
-void mt_tester(void) {
+void mt_tester(std::function<void(const std::vector<FNTree::KeyValuePair*>&)> lookup) {
 	static constexpr size_t threadCount = 8;
 	std::thread tpool[threadCount];
-	static std::atomic<bool> waitForStart = true;
+	std::atomic<bool> waitForStart(true);
 
 	for (size_t i = 0; i < threadCount; ++i)
 	{
@@ -159,10 +340,10 @@ void mt_tester(void) {
 
 			}
 			auto start = high_resolution_clock::now();
-			lookup_func_spec(myCopy);
+			lookup(myCopy);
 			auto stop = high_resolution_clock::now();
 			auto duration = duration_cast<microseconds>(stop - start);
-			std::printf("%s -> US %llu\n", "threaded lookup", duration.count());
+			std::printf("%s -> US %lld\n", "threaded lookup", (long long)duration.count());
 
 		});
 	}
@@ -174,6 +355,946 @@ void mt_tester(void) {
 	}
 }
 
+static size_t checkFailures = 0;
+
+static void check(bool ok, const char* what) {
+	if (!ok) {
+		printf("CHECK FAILED: %s\n", what);
+		checkFailures += 1;
+	}
+}
+
+static void checkIndexOrder() {
+	FNTree::IndexObj index;
+	std::map<size_t, void*> expected;
+	check(index.begin() == index.end(), "empty index iterates nothing");
+	std::mt19937_64 g(7);
+	static constexpr size_t keyMask = ((size_t)1 << FNTree::IndexObj::mapKeySize) - 1;
+	while (expected.size() < 20000) {
+		size_t key = g() & keyMask;
+		expected[key] = (void*)(key + 1);
+		index.insert(key, (void*)(key + 1));
+	}
+	// both ends of the key space
+	expected[0] = (void*)1;
+	index.insert(0, (void*)1);
+	expected[keyMask] = (void*)(keyMask + 1);
+	index.insert(keyMask, (void*)(keyMask + 1));
+
+	auto want = expected.begin();
+	bool ordered = true;
+	for (FNTree::IndexEntry entry : index) {
+		ordered = ordered && want != expected.end() && entry.key == want->first && entry.value == want->second;
+		++want;
+	}
+	check(ordered && want == expected.end(), "forward iteration is ascending and complete");
+
+	auto rwant = expected.rbegin();
+	ordered = true;
+	for (auto it = index.rbegin(); it != index.rend(); ++it) {
+		ordered = ordered && rwant != expected.rend() && (*it).key == rwant->first;
+		++rwant;
+	}
+	check(ordered && rwant == expected.rend(), "reverse iteration is descending and complete");
+
+	bool bounds = true;
+	for (size_t i = 0; i < 2000; ++i)
+	{
+		size_t probe = g() & keyMask;
+		auto it = index.lowerBound(probe);
+		auto ref = expected.lower_bound(probe);
+		bounds = bounds && (ref == expected.end() ? it == index.end() : it != index.end() && (*it).key == ref->first);
+	}
+	check(bounds, "lowerBound finds the smallest key not below the probe");
+	check((*index.lowerBound(keyMask)).key == keyMask, "lowerBound of the largest key");
+	check(index.lowerBound(keyMask + 1) == index.end(), "lowerBound past the key space is end");
+
+	auto lo = std::next(expected.begin(), 100);
+	auto hi = std::next(expected.begin(), 5000);
+	size_t visited = 0;
+	bool inRange = true;
+	index.scan(lo->first, hi->first, [&](size_t key, void*) {
+		inRange = inRange && key >= lo->first && key <= hi->first;
+		visited += 1;
+		return true;
+	});
+	check(inRange && visited == 4901, "scan visits [lo, hi] inclusively");
+	visited = 0;
+	index.scan(lo->first + 1, hi->first - 1, [&](size_t, void*) { visited += 1; return true; });
+	check(visited == 4899, "scan leaves out keys just outside the range");
+	visited = 0;
+	index.scan(0, keyMask, [&](size_t, void*) { return ++visited < 10; });
+	check(visited == 10, "scan stops when the callback returns false");
+
+	static constexpr size_t prefixBits = 5;
+	size_t prefix = (hi->first >> (FNTree::IndexObj::mapKeySize - prefixBits));
+	size_t matching = 0;
+	for (auto& entry : expected)
+	{
+		matching += (entry.first >> (FNTree::IndexObj::mapKeySize - prefixBits)) == prefix;
+	}
+	visited = 0;
+	inRange = true;
+	index.prefixScan(prefix, prefixBits, [&](size_t key, void*) {
+		inRange = inRange && (key >> (FNTree::IndexObj::mapKeySize - prefixBits)) == prefix;
+		visited += 1;
+		return true;
+	});
+	check(inRange && visited == matching, "prefixScan visits exactly the keys under the prefix");
+	visited = 0;
+	index.prefixScan(0, 0, [&](size_t, void*) { visited += 1; return true; });
+	check(visited == expected.size(), "prefixScan with no prefix bits visits everything");
+	visited = 0;
+	index.prefixScan(hi->first, FNTree::IndexObj::mapKeySize + 10, [&](size_t key, void*) { visited += key == hi->first; return true; });
+	check(visited == 1, "prefixScan with more bits than the key visits one key");
+}
+
+/*Writers insert and remove their own keys while readers look everything up. A reader must only
+  ever see a key's own value or nothing, and once every thread is quiet, flushing the epoch has
+  to free everything that was retired.*/
+static void checkLockFreeRemove() {
+	static constexpr size_t writers = 4;
+	static constexpr size_t readers = 2;
+	static constexpr size_t keyCount = 20000;
+	static constexpr size_t rounds = 3;
+	FNTree::LFIndexObj index;
+	FNTree::LFMapObj map;
+	std::vector<FNTree::KeyValuePair> pairs(keyCount);
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		std::memcpy(pairs[k].key, &k, sizeof(k));
+		pairs[k].value = (void*)(k + 1);
+	}
+	std::atomic<size_t> writersDone(0);
+	std::atomic<size_t> quiet(0);
+	std::atomic<size_t> failures(0);
+	auto flushWhenQuiet = [&] {
+		quiet.fetch_add(1);
+		while (quiet.load() != writers + readers) {
+			std::this_thread::yield();
+		}
+		FNTree::Epoch::flush();
+		FNTree::EpochRecord* rec = FNTree::Epoch::local();
+		for (size_t i = 0; i < 3; ++i)
+		{
+			failures += !rec->limbo[i].empty();
+		}
+	};
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < writers; ++t)
+	{
+		threads.emplace_back([&, t] {
+			for (size_t round = 0; round < rounds; ++round)
+			{
+				for (size_t k = t; k < keyCount; k += writers)
+				{
+					index.insert(k, (void*)(k + 1));
+					map.insert(&pairs[k]);
+					failures += index.find(k) != (void*)(k + 1) || map.find(&pairs[k]) != (void*)(k + 1);
+				}
+				// the last round takes out every key, the others every other one
+				for (size_t k = t; k < keyCount; k += round + 1 == rounds ? writers : 2 * writers)
+				{
+					failures += index.remove(k) != (void*)(k + 1) || map.remove(&pairs[k]) != (void*)(k + 1);
+					failures += index.find(k) != nullptr || map.find(&pairs[k]) != nullptr;
+				}
+			}
+			writersDone.fetch_add(1);
+			flushWhenQuiet();
+		});
+	}
+	for (size_t t = 0; t < readers; ++t)
+	{
+		threads.emplace_back([&] {
+			while (writersDone.load() != writers) {
+				for (size_t k = 0; k < keyCount; ++k)
+				{
+					void* found = index.find(k);
+					failures += found != nullptr && found != (void*)(k + 1);
+					found = map.find(&pairs[k]);
+					failures += found != nullptr && found != (void*)(k + 1);
+				}
+			}
+			flushWhenQuiet();
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	check(failures.load() == 0, "lock-free finds during removes see a key's value or nothing");
+	FNTree::StatsReport indexStats = index.stats();
+	FNTree::StatsReport mapStats = map.stats();
+	check(indexStats.total.entries == 0 && mapStats.total.entries == 0, "lock-free trees are empty after removing every key");
+	// two removers emptying one node can each see the other's key and both leave it, a quiet
+	// pass over the same keys walks into whatever was left and has to prune all of it
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		index.insert(k, (void*)(k + 1));
+		map.insert(&pairs[k]);
+	}
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		index.remove(k);
+		map.remove(&pairs[k]);
+	}
+	indexStats = index.stats();
+	mapStats = map.stats();
+	check(indexStats.total.nodes <= 1 && mapStats.total.nodes <= 1, "lock-free removes prune emptied nodes");
+}
+
+/*A recycled block may only come back for a request of the same size and alignment.*/
+static void checkSlabFreeLists() {
+	FNTree::SlabAllocator alloc;
+	void* loose = alloc.allocate(64, 8);
+	if ((uintptr_t)loose % 64 == 0) {
+		// a block that happens to be 64 aligned would pass either way
+		alloc.allocate(8, 8);
+		loose = alloc.allocate(64, 8);
+	}
+	alloc.recycle(loose, 64, 8);
+	void* aligned = alloc.allocate(64, 64);
+	check((uintptr_t)aligned % 64 == 0, "a recycled block is not handed out for a stricter alignment");
+	check(alloc.allocate(64, 8) == loose, "a recycled block is reused for the same size and alignment");
+}
+
+/*Pairs whose keys are 0 to count - 1 and whose values are key + 1, so no value is null.*/
+static std::vector<FNTree::KeyValuePair> numberedPairs(size_t count) {
+	std::vector<FNTree::KeyValuePair> pairs(count);
+	for (size_t k = 0; k < count; ++k)
+	{
+		std::memcpy(pairs[k].key, &k, sizeof(k));
+		pairs[k].value = (void*)(k + 1);
+	}
+	return pairs;
+}
+
+/*Whether map finds every step-th pair from from on with its numbered value.*/
+template <class Map>
+static bool findsAll(Map& map, std::vector<FNTree::KeyValuePair>& pairs, size_t step, size_t from) {
+	bool found = true;
+	for (size_t k = from; k < pairs.size(); k += step)
+	{
+		found = found && map.find(&pairs[k]) == (void*)(k + 1);
+	}
+	return found;
+}
+
+/*Besides the map itself, puts keys into one leaf slot under a single hash. They then share a
+  tag and are only told apart by comparing keys.*/
+static void checkBucketMap() {
+	static constexpr size_t keyCount = 100000;
+	// enough keys for several overflow buckets
+	static constexpr size_t collidingCount = 8 * FNTree::LeafBucket::slotCount;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount + 1);
+	FNTree::KeyValuePair missing = pairs.back();
+	pairs.pop_back();
+	FNTree::BucketMapObj map;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		map.insert(&pairs[k]);
+	}
+	check(findsAll(map, pairs, 1, 0), "bucket map finds every key");
+	check(map.find(&missing) == nullptr, "bucket map misses a key it never got");
+	FNTree::KeyValuePair update = pairs[42];
+	update.value = (void*)7;
+	map.insert(&update);
+	check(map.find(&pairs[42]) == (void*)7 && map.find(&pairs[43]) == (void*)44, "bucket map overwrites an existing key");
+
+	FNTree::SlabAllocator alloc;
+	void* slot = nullptr;
+	size_t hash = 0xA5A5A5A5A5A5A5A5ULL;
+	for (size_t k = 0; k < collidingCount; ++k)
+	{
+		FNTree::putBucket(&slot, hash, &pairs[k], alloc);
+	}
+	bool found = true;
+	for (size_t k = 0; k < collidingCount; ++k)
+	{
+		found = found && FNTree::getBucket(slot, hash, &pairs[k]) == (void*)(k + 1);
+	}
+	check(found, "keys with colliding tags are all found through the overflow buckets");
+	check(FNTree::getBucket(slot, hash, &missing) == nullptr, "a key with a colliding tag that was never put misses");
+	FNTree::putBucket(&slot, hash, &update, alloc);
+	check(FNTree::getBucket(slot, hash, &pairs[42]) == (void*)7 && FNTree::getBucket(slot, hash, &pairs[41]) == (void*)42, "putting a key with a colliding tag again overwrites only that key");
+}
+
+/*Spreading keys over the whole 25 bit key space fills the top CompactBitNodes and leaves the
+  lower ones sparse, so node arrays grow at every level.*/
+static void checkCompactTrees() {
+	static constexpr size_t keyCount = 100000;
+	static constexpr size_t keyMask = ((size_t)1 << FNTree::CompactIndexObj::mapKeySize) - 1;
+	// an odd multiplier is a bijection on the key space, so no two k share a key
+	auto spread = [](size_t k) { return (k * 2654435761ULL) & keyMask; };
+	FNTree::CompactIndexObj index;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		index.insert(spread(k), (void*)(k + 1));
+	}
+	bool found = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		found = found && index.find(spread(k)) == (void*)(k + 1);
+	}
+	check(found, "compact index finds every key");
+	check(index.find(spread(keyCount)) == nullptr, "compact index misses a key it never got");
+	index.insert(spread(42), (void*)7);
+	check(index.find(spread(42)) == (void*)7 && index.find(spread(43)) == (void*)44, "compact index overwrites an existing key");
+	check(index.stats().total.entries == keyCount, "a compact index overwrite adds no entry");
+
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount + 1);
+	FNTree::KeyValuePair missing = pairs.back();
+	pairs.pop_back();
+	FNTree::CompactMapObj map;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		map.insert(&pairs[k]);
+	}
+	check(findsAll(map, pairs, 1, 0), "compact map finds every key");
+	check(map.find(&missing) == nullptr, "compact map misses a key it never got");
+	FNTree::KeyValuePair update = pairs[42];
+	update.value = (void*)7;
+	map.insert(&update);
+	check(map.find(&pairs[42]) == (void*)7 && map.find(&pairs[43]) == (void*)44, "compact map overwrites an existing key");
+	check(map.stats().total.entries == keyCount, "a compact map overwrite adds no entry");
+}
+
+/*Keys that differ only in the root bits land in different roots under the same path, keys that
+  differ only below them share a root.*/
+static void checkWideIndex() {
+	static constexpr size_t subKeySize = FNTree::WideIndexObj::subKeySize;
+	static constexpr size_t low = 0x123456789ABULL;
+	static constexpr size_t keyCount = 100000;
+	FNTree::WideIndexObj index;
+	// every other root gets a key, all with the same low bits
+	for (size_t root = 0; root < FNTree::WideIndexObj::rootCount; root += 2)
+	{
+		index.insert(root << subKeySize | low, (void*)(root + 1));
+	}
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		index.insert((size_t)1 << subKeySize | k * 7919, (void*)(k + 1));
+	}
+	bool found = true;
+	bool missed = true;
+	for (size_t root = 0; root < FNTree::WideIndexObj::rootCount; root += 2)
+	{
+		found = found && index.find(root << subKeySize | low) == (void*)(root + 1);
+		missed = missed && index.find((root + 1) << subKeySize | low) == nullptr;
+	}
+	check(found, "keys that differ only in the root bits are all found");
+	check(missed, "a key whose root bits were never inserted misses");
+	found = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		found = found && index.find((size_t)1 << subKeySize | k * 7919) == (void*)(k + 1);
+	}
+	check(found, "keys under one root are all found");
+	check(index.find((size_t)1 << subKeySize | 7920) == nullptr && index.find(low ^ 1) == nullptr, "a key below a used root that was never inserted misses");
+	// no key holds a value this large
+	void* updated = (void*)(keyCount + FNTree::WideIndexObj::rootCount);
+	index.insert((size_t)4 << subKeySize | low, updated);
+	check(index.find((size_t)4 << subKeySize | low) == updated && index.find((size_t)6 << subKeySize | low) == (void*)7, "wide index overwrites an existing key");
+	check(index.stats().total.entries == FNTree::WideIndexObj::rootCount / 2 + keyCount, "a wide index overwrite adds no entry");
+}
+
+/*Every prefix of one long key goes in as a key of its own, so keys only differ in their length.*/
+static void checkStrMap() {
+	static constexpr size_t keyCount = 100000;
+	static constexpr size_t longest = 300;
+	std::string full;
+	for (size_t i = 0; i < longest + 1; ++i)
+	{
+		full.push_back((char)('a' + i % 26));
+	}
+	// a zero byte inside the keys must not end them
+	full[longest / 2] = '\0';
+	FNTree::StrMapObj map;
+	for (size_t len = 1; len <= longest; ++len)
+	{
+		map.insert(std::string_view(full.data(), len), (void*)len);
+	}
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		map.insert("key" + std::to_string(k), (void*)(k + 1));
+	}
+	bool found = true;
+	for (size_t len = 1; len <= longest; ++len)
+	{
+		found = found && map.find(std::string_view(full.data(), len)) == (void*)len;
+	}
+	check(found, "keys sharing a prefix are told apart by their length");
+	found = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		found = found && map.find("key" + std::to_string(k)) == (void*)(k + 1);
+	}
+	check(found, "string map finds every key");
+	check(map.find(full) == nullptr && map.find("key" + std::to_string(keyCount)) == nullptr, "string map misses a key it never got");
+	std::string changed = full.substr(0, longest / 2 + 1);
+	changed.back() = 'z';
+	check(map.find(changed) == nullptr, "a key that differs after the shared prefix misses");
+	map.insert(std::string_view(full.data(), 10), (void*)(longest + 1));
+	check(map.find(std::string_view(full.data(), 10)) == (void*)(longest + 1) && map.find(std::string_view(full.data(), 11)) == (void*)11,
+		"string map overwrites an existing key");
+	check(map.stats().total.entries == longest + keyCount, "a string map overwrite adds no entry");
+}
+
+/*Builder threads each own part of the key space, and every key has to be found afterwards
+  whatever the split.*/
+static void checkBulkLoad() {
+	static constexpr size_t keyCount = 100000;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount + 1);
+	FNTree::KeyValuePair missing = pairs.back();
+	pairs.pop_back();
+	std::vector<FNTree::KeyValuePair*> pointers(keyCount);
+	std::vector<size_t> keys(keyCount);
+	std::vector<void*> values(keyCount);
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		pointers[k] = &pairs[k];
+		keys[k] = k * 37;
+		values[k] = (void*)(k + 1);
+	}
+	for (size_t threads : {2, 4, 7})
+	{
+		FNTree::IndexObj index;
+		FNTree::MapObj map;
+		index.bulkLoad(keys.data(), values.data(), keyCount, threads);
+		map.bulkLoad(pointers.data(), keyCount, threads);
+		bool found = true;
+		for (size_t k = 0; k < keyCount; ++k)
+		{
+			found = found && index.find(k * 37) == (void*)(k + 1);
+		}
+		check(found, "a bulk loaded index finds every key");
+		check(index.find(38) == nullptr && index.stats().total.entries == keyCount, "a bulk loaded index holds nothing else");
+		check(findsAll(map, pairs, 1, 0), "a bulk loaded map finds every key");
+		check(map.find(&missing) == nullptr && map.stats().total.entries == keyCount, "a bulk loaded map holds nothing else");
+	}
+	// more builders than keys
+	FNTree::IndexObj index;
+	FNTree::MapObj map;
+	index.bulkLoad(keys.data(), values.data(), 3, 8);
+	map.bulkLoad(pointers.data(), 3, 8);
+	check(index.find(37) == (void*)2 && index.stats().total.entries == 3, "bulk loading fewer keys than threads into an index");
+	check(map.find(&pairs[2]) == (void*)3 && map.stats().total.entries == 3, "bulk loading fewer keys than threads into a map");
+}
+
+/*A reopened snapshot has to answer every lookup the way the tree it was saved from does.*/
+static void checkSnapshots() {
+	static constexpr size_t keyCount = 100000;
+	static constexpr const char* path = "fnt-check.snap";
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount + 1);
+	FNTree::KeyValuePair missing = pairs.back();
+	pairs.pop_back();
+	FNTree::IndexObj index;
+	FNTree::MapOptions options;
+	options.partitionLevels = 2;
+	// chain limit 1 saves split chains as well
+	options.chainLimit = 1;
+	FNTree::MapObj map(options);
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		index.insert(k * 37, (void*)(k + 1));
+		map.insert(&pairs[k]);
+	}
+
+	FNTree::IndexSnapshot indexSnapshot;
+	check(index.saveSnapshot(path) && indexSnapshot.open(path), "an index snapshot saves and reopens");
+	bool same = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		same = same && indexSnapshot.find(k * 37) == index.find(k * 37);
+	}
+	check(same, "an index snapshot finds every key the index does");
+	check(indexSnapshot.find(38) == nullptr && indexSnapshot.find(keyCount * 37) == nullptr, "an index snapshot misses a key the index never got");
+	// the map's image goes to the same path
+	indexSnapshot.close();
+
+	FNTree::MapSnapshot mapSnapshot;
+	check(map.saveSnapshot(path) && mapSnapshot.open(path), "a map snapshot saves and reopens");
+	same = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		same = same && mapSnapshot.find(&pairs[k]) == map.find(&pairs[k]);
+	}
+	check(same && findsAll(map, pairs, 1, 0), "a map snapshot finds every key the map does");
+	check(mapSnapshot.find(&missing) == nullptr, "a map snapshot misses a key the map never got");
+	unlink(path);
+}
+
+/*A version keeps what the tree held when it was taken, whatever writers do afterwards.*/
+static void checkVersions() {
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(3);
+	FNTree::KeyValuePair newer = pairs[1];
+	newer.value = (void*)7;
+	FNTree::VersionedIndexObj index;
+	FNTree::VersionedMapObj map;
+	index.insert(1, (void*)2);
+	map.insert(&pairs[1]);
+	FNTree::VersionedIndexObj::Version oldIndex = index.snapshot();
+	FNTree::VersionedMapObj::Version oldMap = map.snapshot();
+	index.insert(1, (void*)7);
+	index.insert(2, (void*)3);
+	map.insert(&newer);
+	map.insert(&pairs[2]);
+	check(oldIndex.find(1) == (void*)2 && oldIndex.find(2) == nullptr, "an index version keeps the old value and misses later keys");
+	check(oldMap.find(&pairs[1]) == (void*)2 && oldMap.find(&pairs[2]) == nullptr, "a map version keeps the old value and misses later keys");
+	check(index.find(1) == (void*)7 && index.find(2) == (void*)3, "the live index sees the overwrite and the new key");
+	check(map.find(&pairs[1]) == (void*)7 && map.find(&pairs[2]) == (void*)3, "the live map sees the overwrite and the new key");
+	FNTree::VersionedIndexObj::Version newIndex = index.snapshot();
+	FNTree::VersionedMapObj::Version newMap = map.snapshot();
+	check(newIndex.find(1) == (void*)7 && newMap.find(&pairs[2]) == (void*)3, "a later version sees the later writes");
+}
+
+/*One thread reads a version it holds while another overwrites every key it has and adds as many
+  again, taking versions of its own along the way.*/
+static void checkVersionsConcurrently() {
+	static constexpr size_t keyCount = 20000;
+	static constexpr size_t rounds = 5;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(2 * keyCount);
+	std::vector<FNTree::KeyValuePair> overwrites = numberedPairs(keyCount);
+	FNTree::VersionedIndexObj index;
+	FNTree::VersionedMapObj map;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		index.insert(k, (void*)(k + 1));
+		map.insert(&pairs[k]);
+		overwrites[k].value = (void*)(k + 2);
+	}
+	FNTree::VersionedIndexObj::Version heldIndex = index.snapshot();
+	FNTree::VersionedMapObj::Version heldMap = map.snapshot();
+	std::atomic<bool> writing(true);
+	std::atomic<size_t> failures(0);
+	std::thread reader([&] {
+		do {
+			for (size_t k = 0; k < 2 * keyCount; ++k)
+			{
+				void* expected = k < keyCount ? (void*)(k + 1) : nullptr;
+				failures += heldIndex.find(k) != expected || heldMap.find(&pairs[k]) != expected;
+			}
+		} while (writing.load());
+	});
+	std::thread writer([&] {
+		for (size_t round = 0; round < rounds; ++round)
+		{
+			for (size_t k = 0; k < keyCount; ++k)
+			{
+				index.insert(k, (void*)(k + 2));
+				map.insert(&overwrites[k]);
+				index.insert(keyCount + k, (void*)(keyCount + k + 1));
+				map.insert(&pairs[keyCount + k]);
+				if (k % 1000 == 0) {
+					// dropped at once, so later writes copy some paths and write others in place
+					index.snapshot();
+					map.snapshot();
+				}
+			}
+		}
+		writing.store(false);
+	});
+	writer.join();
+	reader.join();
+	check(failures.load() == 0, "a held version reads the same while a writer mutates the tree");
+	bool live = true;
+	for (size_t k = 0; k < 2 * keyCount; ++k)
+	{
+		void* expected = k < keyCount ? (void*)(k + 2) : (void*)(k + 1);
+		live = live && index.find(k) == expected && map.find(&pairs[k]) == expected;
+	}
+	check(live, "the live tree has every write once the writer is done");
+}
+
+/*Too large for a slot, so typed trees box it.*/
+struct BoxedValue {
+	uint64_t low;
+	uint64_t high;
+};
+
+/*A stored 0 has to be told apart from an empty slot, inline or boxed. In the index, key 5's
+  neighbours share its last level node.*/
+template <class V>
+static void checkTypedZero(const char* kind) {
+	static const V zero = {};
+	V seven = {};
+	std::memset(&seven, 7, sizeof(seven));
+	auto isZero = [&](const V& value) { return std::memcmp(&value, &zero, sizeof(V)) == 0; };
+	auto what = [&](const char* text) { return std::string(kind) + text; };
+	FNTree::TypedIndexObj<V> index;
+	FNTree::TypedMapObj<size_t, V> map;
+	index.insert(5, zero);
+	map.insert(5, zero);
+	V indexGot = seven;
+	V mapGot = seven;
+	check(index.find(5, indexGot) && isZero(indexGot), what(" index finds a stored 0").c_str());
+	check(map.find(5, mapGot) && isZero(mapGot), what(" map finds a stored 0").c_str());
+	check(!index.find(4, indexGot) && !index.find(6, indexGot), what(" index misses the neighbours of a stored 0").c_str());
+	check(!map.find(4, mapGot) && !map.find(6, mapGot), what(" map misses the neighbours of a stored 0").c_str());
+	index.insert(5, seven);
+	map.insert(5, seven);
+	index.insert(5, zero);
+	map.insert(5, zero);
+	indexGot = seven;
+	mapGot = seven;
+	check(index.find(5, indexGot) && isZero(indexGot) && map.find(5, mapGot) && isZero(mapGot), what(" trees find a 0 written over another value").c_str());
+}
+
+static void checkTypedTrees() {
+	static_assert(FNTree::TypedIndexObj<int>::inlineValues && !FNTree::TypedIndexObj<BoxedValue>::inlineValues);
+	checkTypedZero<int>("inline");
+	checkTypedZero<BoxedValue>("boxed");
+}
+
+/*Writers insert and remove their own keys under a lock policy while readers look everything
+  up. A split threshold of 1 splits a partition on its first contended acquisition.*/
+template <class Lock>
+static void checkLockPolicy(const char* kind) {
+	static constexpr size_t writers = 3;
+	static constexpr size_t readers = 2;
+	static constexpr size_t keyCount = 30000;
+	static constexpr size_t rounds = 3;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount);
+	FNTree::MapOptions options;
+	options.partitionLevels = 2;
+	options.splitThreshold = 1;
+	FNTree::BasicMapObj<FNTree::SlabAllocator, 25, 32, 3, Lock> map(options);
+	std::atomic<size_t> writersDone(0);
+	std::atomic<size_t> failures(0);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < writers; ++t)
+	{
+		threads.emplace_back([&, t] {
+			for (size_t round = 0; round < rounds; ++round)
+			{
+				for (size_t k = t; k < keyCount; k += writers)
+				{
+					map.insert(&pairs[k]);
+					failures += map.find(&pairs[k]) != (void*)(k + 1);
+				}
+				// every round but the last takes all of them out again, the last every other one
+				for (size_t k = t; k < keyCount; k += round + 1 == rounds ? 2 * writers : writers)
+				{
+					failures += map.remove(&pairs[k]) != (void*)(k + 1);
+					failures += map.find(&pairs[k]) != nullptr;
+				}
+			}
+			writersDone.fetch_add(1);
+		});
+	}
+	for (size_t t = 0; t < readers; ++t)
+	{
+		threads.emplace_back([&] {
+			while (writersDone.load() != writers) {
+				for (size_t k = 0; k < keyCount; ++k)
+				{
+					void* found = map.find(&pairs[k]);
+					failures += found != nullptr && found != (void*)(k + 1);
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	std::string what(kind);
+	check(failures.load() == 0, (what + " finds during writes see a key's value or nothing").c_str());
+	bool left = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		// writer k % writers removed k in its last round when k / writers is even
+		void* expected = (k / writers) % 2 == 0 ? nullptr : (void*)(k + 1);
+		left = left && map.find(&pairs[k]) == expected;
+	}
+	check(left, (what + " map holds exactly the keys its writers left").c_str());
+	check(map.stats().total.entries == keyCount / 2, (what + " map counts the keys its writers left").c_str());
+}
+
+static void checkLockPolicies() {
+	checkLockPolicy<FNTree::SpinLock>("SpinLock");
+	checkLockPolicy<FNTree::SharedLock>("SharedLock");
+}
+
+/*Slim trees keep their nodes in vectors, so every key has to survive the vectors moving.*/
+static void checkSlimTrees() {
+	static constexpr size_t keyCount = 100000;
+	FNTree::SlimIndexObj index;
+	index.insert(0, (void*)1);
+	size_t indexCapacity = index._store.nodes.capacity();
+	for (size_t k = 1; k < keyCount; ++k)
+	{
+		index.insert(k * 37, (void*)(k + 1));
+	}
+	check(index._store.nodes.capacity() > indexCapacity, "slim index nodes were reallocated");
+	bool found = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		found = found && index.find(k * 37) == (void*)(k + 1);
+	}
+	check(found, "slim index finds every key past a reallocation");
+	check(index.find(37 * keyCount) == nullptr && index.find(38) == nullptr, "slim index misses a key it never got");
+	index.insert(37 * 42, (void*)7);
+	check(index.find(37 * 42) == (void*)7 && index.find(37 * 43) == (void*)44, "slim index overwrites an existing key");
+
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount + 1);
+	FNTree::KeyValuePair missing = pairs.back();
+	pairs.pop_back();
+	FNTree::SlimMapObj map;
+	map.insert(&pairs[0]);
+	size_t mapCapacity = map._store.nodes.capacity();
+	size_t leafCapacity = map._store.leaves.capacity();
+	for (size_t k = 1; k < keyCount; ++k)
+	{
+		map.insert(&pairs[k]);
+	}
+	check(map._store.nodes.capacity() > mapCapacity && map._store.leaves.capacity() > leafCapacity, "slim map nodes and leaves were reallocated");
+	check(findsAll(map, pairs, 1, 0), "slim map finds every key past a reallocation");
+	check(map.find(&missing) == nullptr, "slim map misses a key it never got");
+	FNTree::KeyValuePair update = pairs[42];
+	update.value = (void*)7;
+	map.insert(&update);
+	check(map.find(&pairs[42]) == (void*)7 && map.find(&pairs[43]) == (void*)44, "slim map overwrites an existing key");
+	check(map.stats().total.entries == keyCount, "a slim map overwrite adds no entry");
+}
+
+static void checkRemove() {
+	static constexpr size_t keyCount = 100000;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount);
+	FNTree::MapObj map;
+	FNTree::IndexObj index;
+	FNTree::MTIndexObj mtIndex;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		map.insert(&pairs[k]);
+		index.insert(k, (void*)(k + 1));
+		mtIndex.insert(k, (void*)(k + 1));
+	}
+	size_t mapNodes = map.stats().total.nodes;
+	size_t mtIndexNodes = mtIndex.stats().total.nodes;
+	bool removed = true;
+	for (size_t k = 0; k < keyCount; k += 2)
+	{
+		removed = removed && map.remove(&pairs[k]) == (void*)(k + 1);
+		removed = removed && index.remove(k) == (void*)(k + 1) && mtIndex.remove(k) == (void*)(k + 1);
+	}
+	check(removed, "remove returns the removed value");
+	check(map.remove(&pairs[0]) == nullptr && index.remove(0) == nullptr && mtIndex.remove(0) == nullptr, "removing a missing key returns null");
+	bool gone = true;
+	bool kept = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		if (k % 2 == 0) {
+			gone = gone && map.find(&pairs[k]) == nullptr && index.find(k) == nullptr && mtIndex.find(k) == nullptr;
+		} else {
+			kept = kept && index.find(k) == (void*)(k + 1) && mtIndex.find(k) == (void*)(k + 1);
+		}
+	}
+	check(gone, "removed keys are not found");
+	check(kept && findsAll(map, pairs, 2, 1), "removing half the keys leaves the other half");
+	for (size_t k = 1; k < keyCount; k += 2)
+	{
+		map.remove(&pairs[k]);
+		index.remove(k);
+		mtIndex.remove(k);
+	}
+	FNTree::StatsReport mapStats = map.stats();
+	FNTree::StatsReport indexStats = index.stats();
+	FNTree::StatsReport mtIndexStats = mtIndex.stats();
+	check(mapStats.total.entries == 0 && indexStats.total.entries == 0 && mtIndexStats.total.entries == 0, "trees are empty after removing every key");
+	// partition nodes stay once made, only the nodes below them are pruned
+	check(indexStats.total.nodes <= 1 && mapStats.total.nodes < mapNodes / 2 && mtIndexStats.total.nodes < mtIndexNodes / 2, "removes prune emptied nodes");
+	map.insert(&pairs[7]);
+	index.insert(7, (void*)8);
+	check(map.find(&pairs[7]) == (void*)8 && index.find(7) == (void*)8, "an emptied tree takes inserts again");
+}
+
+static void checkCombining() {
+	static constexpr size_t keyCount = 100000;
+	static constexpr size_t threadCount = 4;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount);
+	FNTree::MapOptions options;
+	options.partitionLevels = 2;
+	options.combineWrites = true;
+	FNTree::MapObj combined(options);
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < threadCount; ++t)
+	{
+		threads.emplace_back([&, t] {
+			for (size_t k = t; k < keyCount; k += threadCount)
+			{
+				combined.insert(&pairs[k]);
+			}
+		});
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	check(findsAll(combined, pairs, 1, 0), "combined inserts from several threads all land");
+	check(combined.stats().total.entries == keyCount, "combined inserts count every entry once");
+	FNTree::KeyValuePair update = pairs[42];
+	update.value = (void*)7;
+	combined.insert(&update);
+	check(combined.find(&pairs[42]) == (void*)7, "a combined insert of an existing key updates it");
+	check(combined.stats().total.entries == keyCount, "a combined update adds no entry");
+}
+
+/*Chain limit 1 splits a chain on every collision, so fan-out nodes show up all over the map.*/
+static void checkChainSplits() {
+	static constexpr size_t keyCount = 100000;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount);
+	std::vector<FNTree::KeyValuePair*> pointers(keyCount);
+	FNTree::MapOptions options;
+	options.partitionLevels = 2;
+	options.chainLimit = 1;
+	FNTree::MapObj split(options);
+	options.chainLimit = 0;
+	FNTree::MapObj plain(options);
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		pointers[k] = &pairs[k];
+		split.insert(&pairs[k]);
+		plain.insert(&pairs[k]);
+	}
+	check(findsAll(split, pairs, 1, 0), "split chains find every key");
+	check(split.stats().total.entries == keyCount, "split chains count every entry");
+	check(split.stats().total.nodes > plain.stats().total.nodes, "colliding chains split into fan-out nodes");
+	std::vector<void*> found(keyCount);
+	split.findBatch(pointers.data(), found.data(), keyCount);
+	bool batched = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		batched = batched && found[k] == (void*)(k + 1);
+	}
+	check(batched, "batched finds follow split chains");
+
+	for (size_t k = 0; k < keyCount; k += 2)
+	{
+		check(split.remove(&pairs[k]) == (void*)(k + 1), "remove from a split chain returns the value");
+	}
+	check(findsAll(split, pairs, 2, 1), "removing from split chains leaves the other keys");
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		split.remove(&pairs[k]);
+		plain.remove(&pairs[k]);
+	}
+	FNTree::StatsReport splitStats = split.stats();
+	check(splitStats.total.entries == 0 && splitStats.total.nodes == plain.stats().total.nodes, "emptied fan-out nodes are freed");
+}
+
+/*Compacts trees with holes left by removes, then checks every key that is left and inserts more.*/
+static void checkCompaction() {
+	static constexpr size_t keyCount = 100000;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount);
+	FNTree::IndexObj index;
+	FNTree::MTIndexObj mtIndex;
+	FNTree::MapOptions options;
+	options.partitionLevels = 2;
+	// chain limit 1 puts fan-out nodes under the chains compaction has to move
+	options.chainLimit = 1;
+	FNTree::MapObj map(options);
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		index.insert(k, (void*)(k + 1));
+		mtIndex.insert(k, (void*)(k + 1));
+		map.insert(&pairs[k]);
+	}
+	for (size_t k = 0; k < keyCount; k += 3)
+	{
+		index.remove(k);
+		mtIndex.remove(k);
+		map.remove(&pairs[k]);
+	}
+	FNTree::CompactReport indexReport = index.compact();
+	FNTree::CompactReport mtIndexReport = mtIndex.compact();
+	FNTree::CompactReport mapReport = map.compact();
+	check(indexReport.bytesAfter <= indexReport.bytesBefore && mtIndexReport.bytesAfter <= mtIndexReport.bytesBefore &&
+		mapReport.bytesAfter <= mapReport.bytesBefore, "compaction does not grow a tree");
+	bool kept = true;
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		void* expected = k % 3 == 0 ? nullptr : (void*)(k + 1);
+		kept = kept && index.find(k) == expected && mtIndex.find(k) == expected && map.find(&pairs[k]) == expected;
+	}
+	check(kept, "compacted trees find exactly the keys that were left");
+	for (size_t k = 0; k < keyCount; k += 3)
+	{
+		index.insert(k, (void*)(k + 1));
+		mtIndex.insert(k, (void*)(k + 1));
+		map.insert(&pairs[k]);
+	}
+	bool refilled = findsAll(map, pairs, 1, 0);
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		refilled = refilled && index.find(k) == (void*)(k + 1) && mtIndex.find(k) == (void*)(k + 1);
+	}
+	check(refilled, "compacted trees take inserts again");
+	check(map.compact().bytesAfter != 0 && findsAll(map, pairs, 1, 0), "a compacted map compacts again");
+	FNTree::IndexObj emptyIndex;
+	FNTree::MapObj emptyMap(options);
+	FNTree::CompactReport emptyIndexReport = emptyIndex.compact();
+	FNTree::CompactReport emptyMapReport = emptyMap.compact();
+	check(emptyIndexReport.bytesAfter == 0 && emptyMapReport.bytesAfter == 0, "compacting an empty tree allocates nothing");
+	emptyIndex.insert(7, (void*)8);
+	emptyMap.insert(&pairs[7]);
+	check(emptyIndex.find(7) == (void*)8 && emptyMap.find(&pairs[7]) == (void*)8, "a compacted empty tree takes inserts");
+}
+
+/*Every write to a front cached map has to invalidate what finds cached, in this thread or another.*/
+static void checkFrontCache() {
+	static constexpr size_t keyCount = 100000;
+	std::vector<FNTree::KeyValuePair> pairs = numberedPairs(keyCount);
+	FNTree::MapOptions options;
+	options.partitionLevels = 2;
+	options.frontCache = true;
+	FNTree::MapObj cached(options);
+	check(cached.find(&pairs[1]) == nullptr, "front cache misses on an empty map");
+	cached.insert(&pairs[1]);
+	check(cached.find(&pairs[1]) == (void*)2, "an insert invalidates a cached miss");
+	FNTree::KeyValuePair changed = pairs[1];
+	changed.value = (void*)9;
+	cached.insert(&changed);
+	check(cached.find(&pairs[1]) == (void*)9, "an update invalidates a cached value");
+	cached.remove(&pairs[1]);
+	check(cached.find(&pairs[1]) == nullptr, "a remove invalidates a cached value");
+	// updates write through to the pair the map holds
+	pairs[1].value = (void*)2;
+	std::thread other([&] { cached.insert(&pairs[1]); });
+	other.join();
+	check(cached.find(&pairs[1]) == (void*)2, "an insert from another thread invalidates this thread's entry");
+	for (size_t k = 0; k < keyCount; ++k)
+	{
+		cached.insert(&pairs[k]);
+	}
+	// the second pass is served from the cache wherever the first one filled it
+	check(findsAll(cached, pairs, 1, 0) && findsAll(cached, pairs, 1, 0), "front cached finds match the map");
+	FNTree::MapObj empty(options);
+	check(empty.find(&pairs[5]) == nullptr, "maps do not share cached entries");
+}
+
+/*Quick correctness checks, run by ctest through fnt_tester --check.*/
+static size_t correctnessTesting() {
+	checkIndexOrder();
+	checkLockFreeRemove();
+	checkSlabFreeLists();
+	checkBucketMap();
+	checkCompactTrees();
+	checkWideIndex();
+	checkStrMap();
+	checkBulkLoad();
+	checkSnapshots();
+	checkVersions();
+	checkVersionsConcurrently();
+	checkTypedTrees();
+	checkLockPolicies();
+	checkSlimTrees();
+	checkRemove();
+	checkCombining();
+	checkChainSplits();
+	checkCompaction();
+	checkFrontCache();
+	printf("%zu checks failed\n", checkFailures);
+	return checkFailures;
+}
+
 /*
 PERF BOOST -O3
 18 bit 64 children
@@ -187,24 +1308,81 @@ ilookup map test -> US 19345
 */
 
 
-static void perfTesting() {
+static void perfTesting(const char* statsPath) {
 	populateBank();
 	populateStrBank();
 	time_function("FNT insert test", tester_func, 1);
-	printf("mem used %zu\n", FNTree::totalMemUsed);
-	printf("coll used %zu\n", FNTree::collCount);
+	FNTree::StatsReport report = aNode.stats();
+	printf("mem used %zu\n", report.total.bytes());
+	printf("coll used %zu\n", report.total.collisions());
 	time_function("FNT lookup test", lookup_func, 1);
-	//deleter_func();
+	time_function("FNT batch lookup test", batch_lookup_func, 1);
+	time_function("FNT parallel reduce test", reduce_func, 1);
+	time_function("FNT bulk load test", bulk_tester_func, 1);
+	time_function("FNT snapshot save test", snapshot_save_func, 1);
+	time_function("FNT snapshot open and lookup test", snapshot_lookup_func, 1);
+	unlink("fnt-test.snap");
+	time_function("FNT versioned insert and snapshot lookup test", versioned_tester_func, 1);
+	typedNode = new FNTree::TypedMapObj<TypedKey, int>();
+	time_function("FNT typed insert test", typed_tester_func, 1);
+	time_function("FNT typed lookup test", typed_lookup_func, 1);
+	bucketNode = new FNTree::BucketMapObj();
+	time_function("FNT bucket insert test", bucket_tester_func, 1);
+	printf("bucket mem used %zu\n", bucketNode->stats().total.bytes());
+	time_function("FNT bucket lookup test", bucket_lookup_func, 1);
+	compactNode = new FNTree::CompactMapObj();
+	time_function("FNT compact insert test", compact_tester_func, 1);
+	printf("compact mem used %zu\n", compactNode->stats().total.bytes());
+	time_function("FNT compact lookup test", compact_lookup_func, 1);
+	slimNode = new FNTree::SlimMapObj();
+	time_function("FNT slim insert test", slim_tester_func, 1);
+	printf("slim mem used %zu\n", slimNode->stats().total.bytes());
+	time_function("FNT slim lookup test", slim_lookup_func, 1);
 
 	time_function("std::unordered_map insert map test", tester_map_func, 1);
 	time_function("std::unordered_map lookup map test", lookup_map_func, 1);
+	strNode = new FNTree::StrMapObj();
+	time_function("FNT string insert test", str_tester_func, 1);
+	time_function("FNT string lookup test", str_lookup_func, 1);
 
-	time_function("FNT Multi-Threaded lookup test", mt_tester, 1);
+	time_function("FNT Multi-Threaded lookup test", []{ mt_tester(lookup_func_spec); }, 1);
+
+	time_function("FNT lock-free insert test", lf_tester_func, 1);
+	time_function("FNT lock-free Multi-Threaded lookup test", []{ mt_tester(lf_lookup_func_spec); }, 1);
+
+	if (statsPath != nullptr) {
+		FILE* statsFile = fopen(statsPath, "w");
+		if (statsFile != nullptr) {
+			aNode.stats().writeJson(statsFile);
+			fclose(statsFile);
+		} else {
+			printf("could not write stats to %s\n", statsPath);
+		}
+	}
+	time_function("FNT remove test", deleter_func, 1);
+	printf("mem used after remove %zu\n", aNode.stats().total.bytes());
 }
 
 int main(int argc, char const *argv[])
 {
-	perfTesting();
+	// --stats <path> writes the map's stats report as JSON, --check skips the timing runs
+	const char* statsPath = nullptr;
+	bool checkOnly = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+			statsPath = argv[++i];
+		} else if (std::strcmp(argv[i], "--check") == 0) {
+			checkOnly = true;
+		}
+	}
+	if (correctnessTesting() != 0) {
+		return 1;
+	}
+	if (checkOnly) {
+		return 0;
+	}
+	perfTesting(statsPath);
 	
 	return 0;
 }
\ No newline at end of file